@@ -1,24 +1,84 @@
 #include "malloc_internal.h"
 
+// Returns the smallest cached mapping that can hold page_size bytes
+static BigAllocHeader *PopCachedBig(MemoryHeap *heap, size_t page_size)
+{
+    BigAllocHeader *best = NULL;
+    for (AllocHeader *header = heap->big_cache; header; header = header->next)
+    {
+        BigAllocHeader *big_header = GetBigAllocHeader(header);
+        if (big_header->mapped_size >= page_size && (!best || big_header->mapped_size < best->mapped_size))
+            best = big_header;
+    }
+
+    if (best)
+    {
+        ListPop(&heap->big_cache, &best->header);
+        heap->num_big_cached -= 1;
+        heap->big_cached_bytes -= best->mapped_size;
+    }
+
+    return best;
+}
+
+static void PushCachedBig(MemoryHeap *heap, BigAllocHeader *big_header)
+{
+    big_header->header = (AllocHeader){};
+    ListPushFront(&heap->big_cache, &big_header->header);
+    heap->num_big_cached += 1;
+    heap->big_cached_bytes += big_header->mapped_size;
+}
+
+static void DrainBigCache(MemoryHeap *heap)
+{
+    while (heap->big_cache)
+    {
+        BigAllocHeader *big_header = GetBigAllocHeader(heap->big_cache);
+        ListPop(&heap->big_cache, heap->big_cache);
+        UnmapHeapMemory(heap, (void *)big_header, big_header->mapped_size);
+    }
+
+    heap->num_big_cached = 0;
+    heap->big_cached_bytes = 0;
+}
+
 void *AllocBig(MemoryHeap *heap, size_t size)
 {
     FT_DebugLog(">> AllocBig(%ld)\n", size);
 
-    size_t page_size = AlignToPageSize(size + sizeof(AllocHeader));
-    void *page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t page_size = AlignToPageSize(size + sizeof(BigAllocHeader));
+    void *page = PopCachedBig(heap, page_size);
+    int is_cached = page != NULL;
+    if (page)
+        page_size = ((BigAllocHeader *)page)->mapped_size;
+    else
+    {
+        page = MapHeapMemory(heap, page_size);
+        FT_Probe2(big_map, page, page_size);
+    }
+
+    if (!page)
+        return NULL;
+
+    BigAllocHeader *big_header = (BigAllocHeader *)page;
+    *big_header = (BigAllocHeader){};
+    big_header->heap = heap;
+    big_header->mapped_size = page_size;
 
-    AllocHeader *header = (AllocHeader *)page;
-    *header = (AllocHeader){};
+    AllocHeader *header = &big_header->header;
     header->size = size;
 
     ListPushFront(&heap->big_allocs, header);
 
+    heap->num_big_allocations += 1;
+    heap->big_requested_bytes += size;
+    heap->big_mapped_bytes += page_size;
+
     void *ptr = (void *)(header + 1);
 
-#ifdef FT_MALLOC_POISON_MEMORY
-    memset(ptr, FT_MALLOC_MEMORY_PATTERN_ALLOCATED_UNTOUCHED, size);
-    memset(ptr + size, FT_MALLOC_MEMORY_PATTERN_NEVER_ALLOCATED, page_size - size - sizeof(AllocHeader));
-#endif
+    // Fresh pages are left untouched, they read as zero
+    if (is_cached)
+        PoisonAllocatedMemory(heap, ptr, size);
 
     return ptr;
 }
@@ -28,29 +88,45 @@ void *ReallocBig(MemoryHeap *heap, void *ptr, size_t new_size)
     FT_DebugLog(">> ReallocBig(%p, %lu)\n", ptr, new_size);
 
     AllocHeader *header = (AllocHeader *)ptr - 1;
-
-    size_t total_size = header->size + sizeof(AllocHeader);
-    size_t page_count = total_size / GetPageSize() + ((total_size % GetPageSize()) != 0);
-
-    size_t new_total_size = new_size + sizeof(AllocHeader);
-    size_t new_page_count = new_total_size / GetPageSize() + ((new_total_size % GetPageSize()) != 0);
+    BigAllocHeader *big_header = GetBigAllocHeader(header);
 
     // If the allocated pages are enough to store new_size bytes,
-    // just change the recorded size and don't move the memory
-    if (new_page_count <= page_count)
+    // just change the recorded size and don't move the memory.
+    // We still move if new_size is not big anymore, since HeapFree
+    // relies on the size to tell big allocations from span allocations.
+    if (new_size + sizeof(BigAllocHeader) <= big_header->mapped_size && new_size >= FT_MALLOC_MIN_BIG_SIZE)
     {
-#ifdef FT_MALLOC_POISON_MEMORY
-        if (header->size > new_size)
-            memset(ptr + new_size, FT_MALLOC_MEMORY_PATTERN_FREED, header->size - new_size);
-#endif
+        // Give the pages we do not need anymore back to the system
+        size_t new_mapped_size = AlignToPageSize(new_size + sizeof(BigAllocHeader));
 
+        // Only poison the pages that stay mapped
+        size_t mapped_end = new_mapped_size - sizeof(BigAllocHeader);
+        if (header->size > new_size)
+            PoisonFreedMemory(heap, ptr + new_size, (header->size < mapped_end ? header->size : mapped_end) - new_size);
+        else
+            PoisonAllocatedMemory(heap, ptr + header->size, new_size - header->size);
+
+        if (new_mapped_size < big_header->mapped_size)
+        {
+            UnmapHeapMemory(heap, (void *)big_header + new_mapped_size, big_header->mapped_size - new_mapped_size);
+            heap->big_mapped_bytes -= big_header->mapped_size - new_mapped_size;
+            big_header->mapped_size = new_mapped_size;
+        }
+
+        heap->big_requested_bytes += new_size;
+        heap->big_requested_bytes -= header->size;
         header->size = new_size;
+
         return ptr;
     }
 
     void *new_ptr = HeapAlloc(heap, new_size);
+    if (!new_ptr)
+        return NULL;
+
     size_t bytes_to_copy = header->size > new_size ? new_size : header->size;
-    memcpy(new_ptr, ptr, bytes_to_copy);
+    FT_Probe3(realloc_copy, ptr, new_ptr, bytes_to_copy);
+    CopyMemory(new_ptr, ptr, bytes_to_copy);
     FreeBig(heap, ptr);
 
     return new_ptr;
@@ -61,11 +137,24 @@ void FreeBig(MemoryHeap *heap, void *ptr)
     FT_DebugLog(">> FreeBig(%p)\n", ptr);
 
     AllocHeader *header = (AllocHeader *)ptr - 1;
+    BigAllocHeader *big_header = GetBigAllocHeader(header);
 
     ListPop(&heap->big_allocs, header);
 
-    size_t page_size = AlignToPageSize(header->size + sizeof(AllocHeader));
-    munmap((void *)header, page_size);
+    heap->num_big_allocations -= 1;
+    heap->big_requested_bytes -= header->size;
+    heap->big_mapped_bytes -= big_header->mapped_size;
+
+    if (heap->num_big_cached < heap->big_cache_capacity && big_header->mapped_size <= heap->big_cache_max_size)
+    {
+        PoisonFreedMemory(heap, ptr, header->size);
+        PushCachedBig(heap, big_header);
+    }
+    else
+    {
+        FT_Probe2(big_unmap, big_header, big_header->mapped_size);
+        UnmapHeapMemory(heap, (void *)big_header, big_header->mapped_size);
+    }
 }
 
 void CleanupBigAllocations(MemoryHeap *heap)
@@ -76,4 +165,60 @@ void CleanupBigAllocations(MemoryHeap *heap)
     {
         FreeBig(heap, (void *)(heap->big_allocs + 1));
     }
+
+    heap->big_cache_capacity = 0;
+    DrainBigCache(heap);
+}
+
+// The cache is rebuilt from scratch, so it only holds mappings of the reserved size
+int ReserveBig(MemoryHeap *heap, size_t size, size_t count)
+{
+    FT_DebugLog(">> ReserveBig(%lu, %lu)\n", size, count);
+
+    size_t page_size = AlignToPageSize(size + sizeof(BigAllocHeader));
+
+    DrainBigCache(heap);
+    heap->big_cache_capacity = count;
+    heap->big_cache_max_size = page_size;
+    heap->reserved_big_count = count;
+    heap->reserved_big_size = page_size;
+
+    for (size_t i = 0; i < count; i += 1)
+    {
+        BigAllocHeader *big_header = MapHeapMemory(heap, page_size);
+        if (!big_header)
+            return -1;
+
+        *big_header = (BigAllocHeader){};
+        big_header->heap = heap;
+        big_header->mapped_size = page_size;
+        PushCachedBig(heap, big_header);
+    }
+
+    return 0;
+}
+
+// Unmaps the cached mappings, except the ones needed for the allocations reserved with HeapReserve
+void TrimBigCache(MemoryHeap *heap)
+{
+    size_t num_kept = 0;
+    AllocHeader *header = heap->big_cache;
+    while (header)
+    {
+        AllocHeader *next = header->next;
+        BigAllocHeader *big_header = GetBigAllocHeader(header);
+        if (num_kept < heap->reserved_big_count && big_header->mapped_size >= heap->reserved_big_size)
+        {
+            num_kept += 1;
+        }
+        else
+        {
+            ListPop(&heap->big_cache, header);
+            heap->num_big_cached -= 1;
+            heap->big_cached_bytes -= big_header->mapped_size;
+            UnmapHeapMemory(heap, (void *)big_header, big_header->mapped_size);
+        }
+
+        header = next;
+    }
 }
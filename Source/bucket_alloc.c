@@ -1,50 +1,7 @@
 #include "malloc_internal.h"
 
-static int GetSizeClass(size_t size)
-{
-    if (size >= FT_MALLOC_MIN_BIG_SIZE)
-        return -1;
-
-    if (size >= FT_MALLOC_MIN_MID_SIZE)
-    {
-        size -= FT_MALLOC_MIN_MID_SIZE;
-
-        int index = (int)(size / FT_MALLOC_MID_SIZE_GRANULARITY);
-        index += GetSizeClass(FT_MALLOC_MAX_SMALL_SIZE);
-
-        return index;
-    }
-
-    if (size <= FT_MALLOC_MIN_SIZE)
-        return 0;
-
-    int index = 1 + (int)(size / FT_MALLOC_SMALL_SIZE_GRANULARITY);
-
-    return index;
-}
-
-static size_t AlignSizeToSizeClass(size_t size)
-{
-    FT_Assert(size < FT_MALLOC_MIN_BIG_SIZE);
-
-    if (size >= FT_MALLOC_MIN_MID_SIZE)
-    {
-        size -= FT_MALLOC_MIN_MID_SIZE;
-        size_t align = FT_MALLOC_MID_SIZE_GRANULARITY;
-        size = FT_MALLOC_MIN_MID_SIZE + ((size + align - 1) / align) * align;
-
-        return size;
-    }
-
-    if (size <= FT_MALLOC_MIN_SIZE)
-        return FT_MALLOC_MIN_SIZE;
-
-    size -= FT_MALLOC_MIN_SIZE;
-    size_t align = FT_MALLOC_SMALL_SIZE_GRANULARITY;
-    size = FT_MALLOC_MIN_SIZE + ((size + align - 1) / align) * align;
-
-    return size;
-}
+volatile unsigned short ft_malloc_alloc_sample_semaphore __attribute__((section(".probes")));
+volatile unsigned short ft_malloc_free_sample_semaphore __attribute__((section(".probes")));
 
 static AllocBucket **GetBucketList(MemoryHeap *heap, size_t size)
 {
@@ -56,138 +13,310 @@ AllocBucket *CreateAllocBucket(MemoryHeap *heap, size_t size, size_t capacity)
     FT_DebugLog(">> CreateAllocBucket(%lu, %lu)\n", size, capacity);
 
     size = AlignSizeToSizeClass(size);
+
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    // The bucket and its headers come first, followed by the pages of user data.
+    // Recalculate capacity because we may allocate more than needed.
+    size_t data_size = AlignToPageSize(size * capacity);
+    capacity = data_size / size;
+
+    size_t metadata_size = AlignToPageSize(sizeof(AllocBucket) + sizeof(AllocHeader) * capacity);
+    size_t page_size = metadata_size + data_size;
+    void *page = MapHeapMemory(heap, page_size);
+    if (!page)
+        return NULL;
+#else
     size_t required_size = sizeof(AllocBucket) + (sizeof(AllocHeader) + size) * capacity;
     size_t page_size = AlignToPageSize(required_size);
-    void *page = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *page = MapHeapMemory(heap, page_size);
+    if (!page)
+        return NULL;
 
     // Recalculate capacity because we may allocate more than needed
     capacity = (page_size - sizeof(AllocBucket)) / (sizeof(AllocHeader) + size);
+#endif
 
     AllocBucket *bucket = (AllocBucket *)page;
     *bucket = (AllocBucket){};
     ListPushFront(GetBucketList(heap, size), bucket);
 
+    bucket->heap = heap;
+    bucket->mapped_size = page_size;
     bucket->alloc_capacity = capacity;
     bucket->alloc_size = size;
 
-    AllocHeader *node = (AllocHeader *)(bucket + 1);
-    bucket->free_blocks = node;
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    bucket->data = page + metadata_size;
+    SetPageMapRange(bucket->data, data_size, bucket);
+#endif
+
+    heap->num_empty_buckets[GetSizeClass(size)] += 1;
 
-    AllocHeader *prev = NULL;
+    // Blocks are handed out in address order
+    AllocHeader **next = &bucket->free_blocks;
     for (size_t i = 0; i < bucket->alloc_capacity; i += 1)
     {
-        if (prev)
-            prev->next = node;
-        node->prev = prev;
-
+        AllocHeader *node = GetBucketHeader(bucket, i);
+        *node = (AllocHeader){};
         node->size = bucket->alloc_size;
         node->bucket = bucket;
 
-#if FT_MALLOC_POISON_MEMORY
-        void *ptr = (void *)(node + 1);
-        memset(ptr, FT_MALLOC_MEMORY_PATTERN_NEVER_ALLOCATED, bucket->alloc_size);
-#endif
-
-        if (i != bucket->alloc_capacity - 1)
-            node->next = (AllocHeader *)((void *)(node + 1) + size);
-        else
-            node->next = NULL;
-
-        prev = node;
-        node = node->next;
+        *next = node;
+        next = &node->next;
     }
 
+    FT_Probe4(bucket_create, bucket, bucket->alloc_size, bucket->alloc_capacity, bucket->mapped_size);
+
     return bucket;
 }
 
 void DestroyAllocBucket(MemoryHeap *heap, AllocBucket *bucket)
 {
-    size_t page_size = sizeof(AllocBucket) + (sizeof(AllocHeader) + bucket->alloc_size) * bucket->alloc_capacity;
-    page_size = AlignToPageSize(page_size);
     ListPop(GetBucketList(heap, bucket->alloc_size), bucket);
 
-    munmap(bucket, page_size);
+    if (bucket->num_allocations == 0)
+        heap->num_empty_buckets[GetSizeClass(bucket->alloc_size)] -= 1;
+
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    SetPageMapRange(bucket->data, bucket->alloc_size * bucket->alloc_capacity, NULL);
+#endif
+
+    FT_Probe3(bucket_destroy, bucket, bucket->alloc_size, bucket->mapped_size);
+
+    UnmapHeapMemory(heap, bucket, bucket->mapped_size);
 }
 
-static void *AllocFromBucket(AllocBucket *bucket)
+static void *AllocFromBucket(AllocBucket *bucket, size_t size)
 {
     FT_DebugLog(">> AllocFromBucket(%lu)\n", bucket->alloc_size);
 
     FT_Assert(bucket->free_blocks != NULL);
 
     AllocHeader *header = bucket->free_blocks;
-    ListPop(&bucket->free_blocks, header);
+    bucket->free_blocks = header->next;
+    header->next = NULL;
 
-    ListPushFront(&bucket->occupied_blocks, header);
+    if (bucket->num_allocations == 0)
+        bucket->heap->num_empty_buckets[GetSizeClass(bucket->alloc_size)] -= 1;
 
-    void *ptr = (void *)(header + 1);
+    header->size = size;
+    bucket->num_allocations += 1;
+    bucket->requested_bytes += size;
 
-#if FT_MALLOC_POISON_MEMORY
-    memset(ptr, FT_MALLOC_MEMORY_PATTERN_ALLOCATED_UNTOUCHED, bucket->alloc_size);
-#endif
+    void *ptr = GetBucketBlockData(bucket, header);
+    PoisonAllocatedMemory(bucket->heap, ptr, size);
 
     return ptr;
 }
 
+static size_t GetNextBucketCapacity(MemoryHeap *heap, int size_class)
+{
+    if (heap->bucket_capacities[size_class] == 0)
+        return malloc_config.min_bucket_capacity;
+
+    return heap->bucket_capacities[size_class];
+}
+
+// Moves the blocks freed since the last time the allocation list ran out
+// back to it, returns whether the bucket has free blocks
+static int CollectFreeBlocks(AllocBucket *bucket)
+{
+    if (bucket->free_blocks)
+        return 1;
+
+    bucket->free_blocks = bucket->local_free_blocks;
+    bucket->local_free_blocks = NULL;
+
+    int was_empty = bucket->num_allocations == 0;
+    AllocHeader *deferred = __atomic_exchange_n(&bucket->deferred_free_blocks, NULL, __ATOMIC_ACQUIRE);
+    while (deferred)
+    {
+        AllocHeader *next = deferred->next;
+
+        bucket->num_allocations -= 1;
+        bucket->requested_bytes -= deferred->size;
+
+        deferred->next = bucket->free_blocks;
+        bucket->free_blocks = deferred;
+
+        deferred = next;
+    }
+
+    // The bucket is about to be allocated from, so it is not released even if it is empty now
+    if (!was_empty && bucket->num_allocations == 0)
+        bucket->heap->num_empty_buckets[GetSizeClass(bucket->alloc_size)] += 1;
+
+    return bucket->free_blocks != NULL;
+}
+
 void *BucketAlloc(MemoryHeap *heap, size_t size)
 {
     FT_DebugLog(">> BucketAlloc(%lu)\n", size);
 
-    AllocBucket *bucket = *GetBucketList(heap, size);
-    while (bucket && bucket->free_blocks == NULL)
+    AllocBucket **list = GetBucketList(heap, size);
+    AllocBucket *bucket = *list;
+    while (bucket && !CollectFreeBlocks(bucket))
     {
         bucket = bucket->next;
     }
 
     if (!bucket)
     {
-#ifdef FT_MALLOC_MIN_ALLOC_CAPACITY
-        size_t capacity = FT_MALLOC_MIN_ALLOC_CAPACITY;
-#else
-        size_t capacity = size <= FT_MALLOC_MAX_SMALL_SIZE ? 100 : 10;
-#endif
-        bucket = CreateAllocBucket(heap, size, capacity);
+        int size_class = GetSizeClass(size);
+        bucket = CreateAllocBucket(heap, size, GetNextBucketCapacity(heap, size_class));
+        if (!bucket)
+            return NULL;
+
+        // Each new bucket of a size class is twice as big as the previous one,
+        // so the number of mappings grows logarithmically with the demand
+        size_t next_capacity = bucket->alloc_capacity * 2;
+        if (next_capacity > malloc_config.max_bucket_capacity)
+            next_capacity = malloc_config.max_bucket_capacity;
+
+        heap->bucket_capacities[size_class] = (uint32_t)next_capacity;
     }
+    else if (bucket != *list)
+    {
+        // Move the bucket to the front so the next allocations don't have to
+        // walk past the full buckets again
+        ListPop(list, bucket);
+        ListPushFront(list, bucket);
+    }
+
+    void *ptr = AllocFromBucket(bucket, size);
+
+#ifdef FT_MALLOC_USDT_PROBES
+    if (FT_ProbeEnabled(alloc_sample))
+    {
+        heap->probe_sample_counter += 1;
+        if (heap->probe_sample_counter % FT_MALLOC_PROBE_SAMPLE_RATE == 0)
+            FT_SemaphoreProbe3(alloc_sample, ptr, size, bucket->alloc_size);
+    }
+#endif
 
-    return AllocFromBucket(bucket);
+    return ptr;
 }
 
 void *BucketRealloc(MemoryHeap *heap, void *ptr, size_t new_size)
 {
     FT_DebugLog(">> BucketRealloc(%lu)\n", new_size);
 
-    AllocHeader *header = ((AllocHeader *)ptr) - 1;
-    AllocBucket *bucket = header->bucket;
+    AllocBucket *bucket = GetAllocationBucket(ptr);
     FT_Assert(bucket != NULL);
+    AllocHeader *header = GetBucketBlockHeader(bucket, ptr);
+
+    if (new_size <= FT_MALLOC_MAX_SMALL_SIZE && GetSizeClass(new_size) == GetSizeClass(header->size))
+    {
+        if (new_size < header->size)
+            PoisonFreedMemory(heap, ptr + new_size, header->size - new_size);
+        else
+            PoisonAllocatedMemory(heap, ptr + header->size, new_size - header->size);
+
+        bucket->requested_bytes += new_size;
+        bucket->requested_bytes -= header->size;
+        header->size = new_size;
 
-    int size_class = GetSizeClass(header->size);
-    int new_size_class = GetSizeClass(new_size);
-    if (size_class == new_size_class)
         return ptr;
+    }
 
     void *new_ptr = HeapAlloc(heap, new_size);
+    if (!new_ptr)
+        return NULL;
+
     size_t copy_size = new_size > header->size ? header->size : new_size;
-    memcpy(new_ptr, ptr, copy_size);
+    FT_Probe3(realloc_copy, ptr, new_ptr, copy_size);
+    CopyMemory(new_ptr, ptr, copy_size);
 
     BucketFree(heap, ptr);
 
     return new_ptr;
 }
 
+static size_t GetNumFreeBlocks(MemoryHeap *heap, int size_class)
+{
+    size_t num_free = 0;
+    for (AllocBucket *bucket = heap->buckets_per_size_class[size_class]; bucket; bucket = bucket->next)
+        num_free += bucket->alloc_capacity - bucket->num_allocations;
+
+    return num_free;
+}
+
+// We keep one empty bucket per size class so a class that repeatedly
+// allocates and frees a few blocks does not map and unmap a bucket every time.
+// Other empty buckets are unmapped, and the class shrinks its next bucket,
+// unless they are needed for the blocks reserved with HeapReserve.
+static void ReleaseEmptyBucket(MemoryHeap *heap, AllocBucket *bucket)
+{
+    int size_class = GetSizeClass(bucket->alloc_size);
+    heap->num_empty_buckets[size_class] += 1;
+    if (heap->num_empty_buckets[size_class] == 1)
+        return;
+
+    if (heap->reserved_blocks[size_class] > 0
+        && GetNumFreeBlocks(heap, size_class) - bucket->alloc_capacity < heap->reserved_blocks[size_class])
+        return;
+
+    DestroyAllocBucket(heap, bucket);
+
+    size_t next_capacity = heap->bucket_capacities[size_class] / 2;
+    if (next_capacity < malloc_config.min_bucket_capacity)
+        next_capacity = malloc_config.min_bucket_capacity;
+
+    heap->bucket_capacities[size_class] = (uint32_t)next_capacity;
+}
+
 void BucketFree(MemoryHeap *heap, void *ptr)
 {
     FT_DebugLog(">> BucketFree()\n");
 
     (void)heap;
-    AllocHeader *header = ((AllocHeader *)ptr) - 1;
-    AllocBucket *bucket = header->bucket;
+    AllocBucket *bucket = GetAllocationBucket(ptr);
     FT_Assert(bucket != NULL);
-    ListPop(&bucket->occupied_blocks, header);
-    ListPushFront(&bucket->free_blocks, header);
+    PoisonFreedMemory(bucket->heap, ptr, GetBucketBlockHeader(bucket, ptr)->size);
+
+    FreeBucketBlock(bucket, ptr);
+}
+
+void FreeBucketBlock(AllocBucket *bucket, void *ptr)
+{
+    AllocHeader *header = GetBucketBlockHeader(bucket, ptr);
+    header->next = bucket->local_free_blocks;
+    bucket->local_free_blocks = header;
 
-#if FT_MALLOC_POISON_MEMORY
-    memset(ptr, FT_MALLOC_MEMORY_PATTERN_FREED, bucket->alloc_size);
+    bucket->num_allocations -= 1;
+    bucket->requested_bytes -= header->size;
+
+#ifdef FT_MALLOC_USDT_PROBES
+    if (FT_ProbeEnabled(free_sample))
+    {
+        bucket->heap->probe_sample_counter += 1;
+        if (bucket->heap->probe_sample_counter % FT_MALLOC_PROBE_SAMPLE_RATE == 0)
+            FT_SemaphoreProbe2(free_sample, ptr, bucket->alloc_size);
+    }
 #endif
+
+    if (bucket->num_allocations == 0)
+        ReleaseEmptyBucket(bucket->heap, bucket);
+}
+
+int DeferBucketFree(void *ptr)
+{
+    FT_DebugLog(">> DeferBucketFree()\n");
+
+    AllocBucket *bucket = GetAllocationBucket(ptr);
+    if (!bucket)
+        return 0;
+
+    // The block is still counted as allocated until the owner of the heap collects it,
+    // so the bucket cannot be released while we push it
+    AllocHeader *header = GetBucketBlockHeader(bucket, ptr);
+    PoisonFreedMemory(bucket->heap, ptr, header->size);
+
+    header->next = __atomic_load_n(&bucket->deferred_free_blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&bucket->deferred_free_blocks, &header->next, header, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+    return 1;
 }
 
 void CleanupBucketAllocations(MemoryHeap *heap)
@@ -202,5 +331,84 @@ void CleanupBucketAllocations(MemoryHeap *heap)
 
             bucket = next;
         }
+
+        heap->bucket_capacities[i] = 0;
+        heap->reserved_blocks[i] = 0;
+    }
+}
+
+void TrimBuckets(MemoryHeap *heap)
+{
+    for (int i = 0; i < FT_MALLOC_NUM_SIZE_CLASS; i += 1)
+    {
+        AllocBucket *bucket = heap->buckets_per_size_class[i];
+        while (bucket)
+        {
+            AllocBucket *next = bucket->next;
+
+            // Deferred frees only count once they are collected, a bucket
+            // with some pending is not empty yet
+            if (bucket->num_allocations == 0
+                && GetNumFreeBlocks(heap, i) - bucket->alloc_capacity >= heap->reserved_blocks[i])
+                DestroyAllocBucket(heap, bucket);
+
+            bucket = next;
+        }
+    }
+}
+
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+void SetBucketPageMaps(MemoryHeap *heap, int attached)
+{
+    for (int i = 0; i < FT_MALLOC_NUM_SIZE_CLASS; i += 1)
+    {
+        for (AllocBucket *bucket = heap->buckets_per_size_class[i]; bucket; bucket = bucket->next)
+            SetPageMapRange(bucket->data, bucket->alloc_size * bucket->alloc_capacity, attached ? bucket : NULL);
     }
 }
+#endif
+
+AllocBucket *GetCompactionTarget(MemoryHeap *heap, AllocBucket *bucket)
+{
+    if (bucket->num_allocations * 2 > bucket->alloc_capacity)
+        return NULL;
+
+    AllocBucket *target = NULL;
+    for (AllocBucket *it = *GetBucketList(heap, bucket->alloc_size); it; it = it->next)
+    {
+        if (it == bucket || it->num_allocations < bucket->num_allocations)
+            continue;
+        if (it->num_allocations == it->alloc_capacity)
+            continue;
+
+        if (!target || it->num_allocations > target->num_allocations)
+            target = it;
+    }
+
+    return target;
+}
+
+void *AllocFromBucketForCompaction(AllocBucket *bucket, size_t size)
+{
+    if (!CollectFreeBlocks(bucket))
+        return NULL;
+
+    return AllocFromBucket(bucket, size);
+}
+
+int ReserveBuckets(MemoryHeap *heap, size_t size, size_t count)
+{
+    FT_DebugLog(">> ReserveBuckets(%lu, %lu)\n", size, count);
+
+    int size_class = GetSizeClass(size);
+    heap->reserved_blocks[size_class] = (uint32_t)count;
+
+    size_t num_free = GetNumFreeBlocks(heap, size_class);
+    if (num_free >= count)
+        return 0;
+
+    if (!CreateAllocBucket(heap, size, count - num_free))
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include "malloc_internal.h"
+
+static MovableHandleBlock *GetMovableHandleBlock(MovableAllocation *handle)
+{
+    return (MovableHandleBlock *)((uintptr_t)handle & ~((uintptr_t)GetPageSize() - 1));
+}
+
+static MovableHandleBlock *CreateMovableHandleBlock(MemoryHeap *heap)
+{
+    MovableHandleBlock *block = MapHeapMemory(heap, GetPageSize());
+    if (!block)
+        return NULL;
+
+    *block = (MovableHandleBlock){};
+    block->capacity = (GetPageSize() - sizeof(MovableHandleBlock)) / sizeof(MovableAllocation);
+
+    // Pushed in reverse so handles are handed out in address order
+    for (uint32_t i = block->capacity; i > 0; i -= 1)
+    {
+        block->handles[i - 1] = (MovableAllocation){};
+        block->handles[i - 1].next_free = block->free_handles;
+        block->free_handles = &block->handles[i - 1];
+    }
+
+    ListPushFront(&heap->movable_handle_blocks, block);
+    heap->num_movable_handle_blocks += 1;
+
+    return block;
+}
+
+static MovableAllocation *AllocMovableHandle(MemoryHeap *heap)
+{
+    MovableHandleBlock *block = heap->movable_handle_blocks;
+    if (!block)
+        block = CreateMovableHandleBlock(heap);
+    if (!block)
+        return NULL;
+
+    MovableAllocation *handle = block->free_handles;
+    block->free_handles = handle->next_free;
+    block->num_handles += 1;
+    heap->num_movable_handles += 1;
+
+    if (block->num_handles == block->capacity)
+    {
+        ListPop(&heap->movable_handle_blocks, block);
+        ListPushFront(&heap->full_movable_handle_blocks, block);
+    }
+
+    *handle = (MovableAllocation){};
+
+    return handle;
+}
+
+// Empty blocks are unmapped, unless they are the only block left with free handles
+static void FreeMovableHandle(MemoryHeap *heap, MovableAllocation *handle)
+{
+    MovableHandleBlock *block = GetMovableHandleBlock(handle);
+    if (block->num_handles == block->capacity)
+    {
+        ListPop(&heap->full_movable_handle_blocks, block);
+        ListPushFront(&heap->movable_handle_blocks, block);
+    }
+
+    handle->ptr = NULL;
+    handle->next_free = block->free_handles;
+    block->free_handles = handle;
+    block->num_handles -= 1;
+    heap->num_movable_handles -= 1;
+
+    if (block->num_handles == 0 && (block->prev || block->next))
+    {
+        ListPop(&heap->movable_handle_blocks, block);
+        heap->num_movable_handle_blocks -= 1;
+        UnmapHeapMemory(heap, block, GetPageSize());
+    }
+}
+
+void CleanupMovableHandles(MemoryHeap *heap)
+{
+    while (heap->movable_handle_blocks)
+    {
+        MovableHandleBlock *block = heap->movable_handle_blocks;
+        ListPop(&heap->movable_handle_blocks, block);
+        UnmapHeapMemory(heap, block, GetPageSize());
+    }
+
+    while (heap->full_movable_handle_blocks)
+    {
+        MovableHandleBlock *block = heap->full_movable_handle_blocks;
+        ListPop(&heap->full_movable_handle_blocks, block);
+        UnmapHeapMemory(heap, block, GetPageSize());
+    }
+
+    heap->num_movable_handle_blocks = 0;
+    heap->num_movable_handles = 0;
+}
+
+MovableHandle HeapAllocMovable(MemoryHeap *heap, size_t size)
+{
+    void *ptr = HeapAlloc(heap, size);
+    if (!ptr)
+        return NULL;
+
+    MovableAllocation *handle = AllocMovableHandle(heap);
+    if (!handle)
+    {
+        HeapFree(heap, ptr);
+        return NULL;
+    }
+
+    handle->ptr = ptr;
+
+    return handle;
+}
+
+void HeapFreeMovable(MemoryHeap *heap, MovableHandle handle)
+{
+    if (!handle)
+        return;
+
+    FT_Assert(handle->pin_count == 0);
+
+    HeapFree(heap, handle->ptr);
+    FreeMovableHandle(heap, handle);
+}
+
+void *PinMovable(MovableHandle handle)
+{
+    handle->pin_count += 1;
+
+    return handle->ptr;
+}
+
+void UnpinMovable(MovableHandle handle)
+{
+    FT_Assert(handle->pin_count > 0);
+
+    handle->pin_count -= 1;
+}
+
+// Returns whether any allocation moved. budget is set to 0 once it runs out.
+static int CompactMovableHandleBlock(MemoryHeap *heap, MovableHandleBlock *block, size_t *budget)
+{
+    int moved = 0;
+    for (uint32_t i = 0; i < block->capacity; i += 1)
+    {
+        MovableAllocation *handle = &block->handles[i];
+        if (!handle->ptr || handle->pin_count > 0 || IsGuardedAllocation(handle->ptr))
+            continue;
+
+        AllocBucket *bucket = GetAllocationBucket(handle->ptr);
+        if (!bucket)
+            continue;
+
+        size_t size = GetBucketBlockHeader(bucket, handle->ptr)->size;
+        if (size > *budget)
+        {
+            *budget = 0;
+            break;
+        }
+
+        AllocBucket *target = GetCompactionTarget(heap, bucket);
+        if (!target)
+            continue;
+
+        void *ptr = AllocFromBucketForCompaction(target, size);
+        if (!ptr)
+            continue;
+
+        FT_Probe3(realloc_copy, handle->ptr, ptr, size);
+        CopyMemory(ptr, handle->ptr, size);
+        BucketFree(heap, handle->ptr);
+        handle->ptr = ptr;
+
+        *budget -= size;
+        moved = 1;
+    }
+
+    return moved;
+}
+
+size_t HeapCompact(MemoryHeap *heap, size_t budget)
+{
+    FT_DebugLog(">> HeapCompact(%lu)\n", budget);
+
+    size_t mapped_bytes = heap->mapped_bytes;
+
+    // Only bucket allocations are moved, span and big allocations
+    // do not keep whole mappings alive the same way.
+    // Moving blocks changes which buckets are worth moving from and to, so keep
+    // going until nothing moves. Blocks only move to buckets with at least as many
+    // allocations as the one they leave, so this terminates.
+    int moved = 1;
+    while (moved && budget > 0)
+    {
+        moved = 0;
+        for (MovableHandleBlock *block = heap->full_movable_handle_blocks; block && budget > 0; block = block->next)
+            moved |= CompactMovableHandleBlock(heap, block, &budget);
+        for (MovableHandleBlock *block = heap->movable_handle_blocks; block && budget > 0; block = block->next)
+            moved |= CompactMovableHandleBlock(heap, block, &budget);
+    }
+
+    // Freeing keeps one empty bucket per size class around, give those back too
+    TrimBuckets(heap);
+
+    return mapped_bytes - heap->mapped_bytes;
+}
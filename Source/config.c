@@ -0,0 +1,221 @@
+#include "malloc_internal.h"
+#include "../ft_malloc_inline.h"
+
+#include <stdlib.h>
+
+MallocConfig malloc_config = {
+#ifdef FT_MALLOC_MIN_ALLOC_CAPACITY
+    .min_bucket_capacity = FT_MALLOC_MIN_ALLOC_CAPACITY,
+    .max_bucket_capacity = FT_MALLOC_MIN_ALLOC_CAPACITY,
+#else
+    .min_bucket_capacity = FT_MALLOC_MIN_BUCKET_CAPACITY,
+    .max_bucket_capacity = FT_MALLOC_MAX_BUCKET_CAPACITY,
+#endif
+    .thread_cache_capacity = FT_MALLOC_THREAD_CACHE_CAPACITY,
+    .big_cache_capacity = FT_MALLOC_BIG_CACHE_CAPACITY,
+    .big_cache_max_size = FT_MALLOC_BIG_CACHE_MAX_SIZE,
+    .non_temporal_threshold = FT_MALLOC_NON_TEMPORAL_THRESHOLD,
+    .guarded_sample_rate = FT_MALLOC_GUARDED_SAMPLE_RATE,
+    .guarded_slots = FT_MALLOC_GUARDED_SLOTS,
+#ifdef FT_MALLOC_POISON_MEMORY
+    .poison_mode = FT_MALLOC_POISON_FULL,
+#endif
+};
+
+static SpinLock config_lock;
+
+static void WriteConfigError(const char *option, size_t length)
+{
+    static const char Prefix[] = "ft_malloc: invalid FT_MALLOC_CONF option '";
+    static const char Suffix[] = "'\n";
+
+    size_t n = write(2, Prefix, sizeof(Prefix) - 1);
+    n = write(2, option, length);
+    n = write(2, Suffix, sizeof(Suffix) - 1);
+    (void)n;
+}
+
+static int MatchKey(const char *key, size_t key_length, const char *name)
+{
+    return strlen(name) == key_length && memcmp(key, name, key_length) == 0;
+}
+
+// Parses a decimal number with an optional k, m or g suffix
+static int ParseSize(const char *str, size_t length, size_t *result)
+{
+    if (length == 0)
+        return 0;
+
+    size_t shift = 0;
+    switch (str[length - 1])
+    {
+    case 'k': case 'K': shift = 10; length -= 1; break;
+    case 'm': case 'M': shift = 20; length -= 1; break;
+    case 'g': case 'G': shift = 30; length -= 1; break;
+    }
+
+    if (length == 0)
+        return 0;
+
+    size_t value = 0;
+    for (size_t i = 0; i < length; i += 1)
+    {
+        if (str[i] < '0' || str[i] > '9')
+            return 0;
+        if (value > (SIZE_MAX - 9) / 10)
+            return 0;
+
+        value = value * 10 + (size_t)(str[i] - '0');
+    }
+
+    if (value > (SIZE_MAX >> shift))
+        return 0;
+
+    *result = value << shift;
+
+    return 1;
+}
+
+static int ParsePoisonMode(const char *str, size_t length, int *result)
+{
+    if (MatchKey(str, length, "off"))
+        *result = FT_MALLOC_POISON_OFF;
+    else if (MatchKey(str, length, "bounded"))
+        *result = FT_MALLOC_POISON_BOUNDED;
+    else if (MatchKey(str, length, "free"))
+        *result = FT_MALLOC_POISON_FREE;
+    else if (MatchKey(str, length, "full"))
+        *result = FT_MALLOC_POISON_FULL;
+    else
+        return 0;
+
+    return 1;
+}
+
+static int ApplyOption(MallocConfig *config, const char *key, size_t key_length, const char *value_str, size_t value_length)
+{
+    if (MatchKey(key, key_length, "poison"))
+        return ParsePoisonMode(value_str, value_length, &config->poison_mode);
+
+    size_t value = 0;
+    if (!ParseSize(value_str, value_length, &value))
+        return 0;
+
+    if (MatchKey(key, key_length, "min_bucket_capacity"))
+    {
+        if (value == 0 || value > UINT32_MAX)
+            return 0;
+        config->min_bucket_capacity = (uint32_t)value;
+    }
+    else if (MatchKey(key, key_length, "max_bucket_capacity"))
+    {
+        if (value == 0 || value > UINT32_MAX)
+            return 0;
+        config->max_bucket_capacity = (uint32_t)value;
+    }
+    else if (MatchKey(key, key_length, "thread_cache_capacity"))
+    {
+        if (value == 0 || value > INT32_MAX)
+            return 0;
+        config->thread_cache_capacity = (uint32_t)value;
+    }
+    else if (MatchKey(key, key_length, "big_cache_capacity"))
+    {
+        config->big_cache_capacity = value;
+    }
+    else if (MatchKey(key, key_length, "big_cache_max_size"))
+    {
+        config->big_cache_max_size = value;
+    }
+    else if (MatchKey(key, key_length, "non_temporal_threshold"))
+    {
+        if (value < 2 * NON_TEMPORAL_BLOCK_SIZE)
+            return 0;
+        config->non_temporal_threshold = value;
+    }
+    else if (MatchKey(key, key_length, "guarded_sample_rate"))
+    {
+        if (value > UINT32_MAX)
+            return 0;
+        config->guarded_sample_rate = (uint32_t)value;
+    }
+    else if (MatchKey(key, key_length, "guarded_slots"))
+    {
+        if (value == 0 || value > UINT32_MAX / 2)
+            return 0;
+        config->guarded_slots = (uint32_t)value;
+    }
+    else if (MatchKey(key, key_length, "stats"))
+    {
+        if (value > 1)
+            return 0;
+        config->print_stats = (uint32_t)value;
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Called before anything is allocated, so this only reads the environment in place
+static void ParseConfig(MallocConfig *config, const char *str)
+{
+    while (*str)
+    {
+        const char *end = strchrnul(str, ',');
+        const char *separator = memchr(str, ':', end - str);
+
+        if (end == str)
+        {
+            // Empty option
+        }
+        else if (!separator || !ApplyOption(config, str, separator - str, separator + 1, end - separator - 1))
+        {
+            WriteConfigError(str, end - str);
+        }
+
+        str = *end ? end + 1 : end;
+    }
+
+    if (config->min_bucket_capacity > config->max_bucket_capacity)
+    {
+        static const char Error[] = "ft_malloc: min_bucket_capacity is greater than max_bucket_capacity, ignoring both\n";
+        size_t n = write(2, Error, sizeof(Error) - 1);
+        (void)n;
+
+        config->min_bucket_capacity = malloc_config.min_bucket_capacity;
+        config->max_bucket_capacity = malloc_config.max_bucket_capacity;
+    }
+}
+
+void LoadMallocConfig()
+{
+    if (__atomic_load_n(&malloc_config.loaded, __ATOMIC_ACQUIRE))
+        return;
+
+    LockSpinLock(&config_lock);
+
+    if (!malloc_config.loaded)
+    {
+        MallocConfig config = malloc_config;
+
+        const char *str = getenv("FT_MALLOC_CONF");
+        if (str)
+            ParseConfig(&config, str);
+
+        config.loaded = 0;
+        malloc_config = config;
+        __atomic_store_n(&malloc_config.loaded, 1, __ATOMIC_RELEASE);
+    }
+
+    UnlockSpinLock(&config_lock);
+}
+
+__attribute__((destructor))
+static void PrintStatsAtExit()
+{
+    if (malloc_config.print_stats)
+        PrintAllocationState();
+}
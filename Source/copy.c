@@ -0,0 +1,143 @@
+#include "malloc_internal.h"
+
+#ifdef __x86_64__
+
+#include <immintrin.h>
+
+// Non temporal stores go straight to memory instead of filling the cache with
+// data the program is not going to read soon. They need an aligned destination,
+// so the unaligned head and the tail are handled with memcpy and memset.
+
+enum
+{
+    NonTemporal_Unresolved,
+    NonTemporal_SSE2,
+    NonTemporal_AVX2,
+};
+
+static int non_temporal_level;
+
+static int GetNonTemporalLevel()
+{
+    int level = __atomic_load_n(&non_temporal_level, __ATOMIC_RELAXED);
+    if (level != NonTemporal_Unresolved)
+        return level;
+
+    // We may be called before the constructors that initialize the CPU model run
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        level = NonTemporal_AVX2;
+    else
+        level = NonTemporal_SSE2;
+
+    __atomic_store_n(&non_temporal_level, level, __ATOMIC_RELAXED);
+
+    return level;
+}
+
+__attribute__((target("avx2")))
+static void CopyNonTemporalAVX2(void *dst, const void *src, size_t size)
+{
+    for (size_t i = 0; i < size; i += NON_TEMPORAL_BLOCK_SIZE)
+    {
+        _mm_prefetch((const char *)src + i + 8 * NON_TEMPORAL_BLOCK_SIZE, _MM_HINT_NTA);
+
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+        _mm256_stream_si256((__m256i *)(dst + i), a);
+        _mm256_stream_si256((__m256i *)(dst + i + 32), b);
+        _mm256_stream_si256((__m256i *)(dst + i + 64), c);
+        _mm256_stream_si256((__m256i *)(dst + i + 96), d);
+    }
+}
+
+static void CopyNonTemporalSSE2(void *dst, const void *src, size_t size)
+{
+    for (size_t i = 0; i < size; i += NON_TEMPORAL_BLOCK_SIZE)
+    {
+        _mm_prefetch((const char *)src + i + 8 * NON_TEMPORAL_BLOCK_SIZE, _MM_HINT_NTA);
+
+        for (size_t j = 0; j < NON_TEMPORAL_BLOCK_SIZE; j += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(src + i + j));
+            _mm_stream_si128((__m128i *)(dst + i + j), a);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void FillNonTemporalAVX2(void *dst, int value, size_t size)
+{
+    __m256i a = _mm256_set1_epi8((char)value);
+    for (size_t i = 0; i < size; i += 32)
+        _mm256_stream_si256((__m256i *)(dst + i), a);
+}
+
+static void FillNonTemporalSSE2(void *dst, int value, size_t size)
+{
+    __m128i a = _mm_set1_epi8((char)value);
+    for (size_t i = 0; i < size; i += 16)
+        _mm_stream_si128((__m128i *)(dst + i), a);
+}
+
+void CopyMemory(void *dst, const void *src, size_t size)
+{
+    // Too small to hold a single aligned block after the head
+    size_t head = AlignPointer(dst, 32) - dst;
+    if (size < malloc_config.non_temporal_threshold || size < head + NON_TEMPORAL_BLOCK_SIZE)
+    {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    size_t body = (size - head) & ~((size_t)NON_TEMPORAL_BLOCK_SIZE - 1);
+    memcpy(dst, src, head);
+
+    if (GetNonTemporalLevel() == NonTemporal_AVX2)
+        CopyNonTemporalAVX2(dst + head, src + head, body);
+    else
+        CopyNonTemporalSSE2(dst + head, src + head, body);
+
+    // Non temporal stores are weakly ordered
+    _mm_sfence();
+
+    memcpy(dst + head + body, src + head + body, size - head - body);
+}
+
+void FillMemory(void *dst, int value, size_t size)
+{
+    size_t head = AlignPointer(dst, 32) - dst;
+    if (size < malloc_config.non_temporal_threshold || size < head + NON_TEMPORAL_BLOCK_SIZE)
+    {
+        memset(dst, value, size);
+        return;
+    }
+
+    size_t body = (size - head) & ~((size_t)NON_TEMPORAL_BLOCK_SIZE - 1);
+    memset(dst, value, head);
+
+    if (GetNonTemporalLevel() == NonTemporal_AVX2)
+        FillNonTemporalAVX2(dst + head, value, body);
+    else
+        FillNonTemporalSSE2(dst + head, value, body);
+
+    _mm_sfence();
+
+    memset(dst + head + body, value, size - head - body);
+}
+
+#else
+
+void CopyMemory(void *dst, const void *src, size_t size)
+{
+    memcpy(dst, src, size);
+}
+
+void FillMemory(void *dst, int value, size_t size)
+{
+    memset(dst, value, size);
+}
+
+#endif
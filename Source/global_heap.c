@@ -0,0 +1,375 @@
+#include "malloc_internal.h"
+
+#include <pthread.h>
+
+MemoryHeap *global_heap;
+
+// Held while creating the global heaps, and across fork so the child
+// never inherits a half created heap
+static SpinLock global_heap_lock;
+static int fork_handlers_registered;
+
+static void PrepareFork();
+static void ResumeParentAfterFork();
+static void ResumeChildAfterFork();
+
+// Must be called with global_heap_lock held
+static MemoryHeap *CreateGlobalHeap()
+{
+    if (!fork_handlers_registered)
+    {
+        pthread_atfork(PrepareFork, ResumeParentAfterFork, ResumeChildAfterFork);
+        fork_handlers_registered = 1;
+    }
+
+    return CreateHeap();
+}
+
+#ifdef FT_MALLOC_PER_CPU_ARENAS
+
+// One heap per CPU, created on first use. global_heap is the arena of CPU 0.
+static MemoryHeap *arenas[FT_MALLOC_MAX_ARENAS];
+
+static MemoryHeap *GetArena(int index)
+{
+    MemoryHeap *heap = __atomic_load_n(&arenas[index], __ATOMIC_ACQUIRE);
+    if (heap)
+        return heap;
+
+    LockSpinLock(&global_heap_lock);
+
+    heap = arenas[index];
+    if (!heap)
+    {
+        heap = CreateGlobalHeap();
+        if (!heap)
+        {
+            UnlockSpinLock(&global_heap_lock);
+            errno = ENOMEM;
+            return NULL;
+        }
+
+#ifdef FT_MALLOC_NUMA_AWARE
+        // Arenas are created by the first thread that allocates on their CPU,
+        // so the current node is the node of the arena's CPU
+        heap->numa_node = GetCurrentNumaNode();
+#endif
+
+        if (index == 0)
+            global_heap = heap;
+
+        __atomic_store_n(&arenas[index], heap, __ATOMIC_RELEASE);
+    }
+
+    UnlockSpinLock(&global_heap_lock);
+
+    return heap;
+}
+
+static MemoryHeap *GetCurrentArena()
+{
+    return GetArena(GetCurrentCpu() % FT_MALLOC_MAX_ARENAS);
+}
+
+// Every arena lock is taken so no heap is in the middle of an operation when
+// the address space is copied. The child only has the thread that called fork,
+// so it can simply reset the locks.
+static void PrepareFork()
+{
+    LockSpinLock(&global_heap_lock);
+
+    for (int i = 0; i < FT_MALLOC_MAX_ARENAS; i += 1)
+    {
+        if (arenas[i])
+            LockSpinLock(&arenas[i]->lock);
+    }
+
+    // Sampled allocations take the guarded lock with an arena lock held
+    PrepareGuardedFork();
+}
+
+static void ResumeParentAfterFork()
+{
+    ResumeGuardedParentAfterFork();
+
+    for (int i = FT_MALLOC_MAX_ARENAS - 1; i >= 0; i -= 1)
+    {
+        if (arenas[i])
+            UnlockSpinLock(&arenas[i]->lock);
+    }
+
+    UnlockSpinLock(&global_heap_lock);
+}
+
+static void ResumeChildAfterFork()
+{
+    ResumeGuardedChildAfterFork();
+
+    for (int i = 0; i < FT_MALLOC_MAX_ARENAS; i += 1)
+    {
+        if (arenas[i])
+            arenas[i]->lock = (SpinLock){};
+    }
+
+    global_heap_lock = (SpinLock){};
+}
+
+void *Alloc(size_t size)
+{
+    MemoryHeap *heap = GetCurrentArena();
+    if (!heap)
+        return NULL;
+
+    LockSpinLock(&heap->lock);
+    void *ptr = HeapAlloc(heap, size);
+    UnlockSpinLock(&heap->lock);
+
+    return ptr;
+}
+
+int AllocBatch(size_t size, void **ptrs, int count)
+{
+    MemoryHeap *heap = GetCurrentArena();
+    if (!heap)
+        return 0;
+
+    // Cached blocks lose the allocated pattern, so they are handed out one at a time
+    if (heap->poison_mode == FT_MALLOC_POISON_FULL)
+        count = 1;
+
+    LockSpinLock(&heap->lock);
+
+    int i = 0;
+    while (i < count && (ptrs[i] = HeapAllocUnsampled(heap, size)) != NULL)
+        i += 1;
+
+    if (malloc_config.guarded_sample_rate != 0 && i > 0)
+        SampleGuardedBatch(heap, size, ptrs, i);
+
+    UnlockSpinLock(&heap->lock);
+
+    return i;
+}
+
+void FreeThreadCacheBlock(void *ptr)
+{
+    // Refills may have put a guarded allocation in the cache
+    if (IsGuardedAllocation(ptr))
+    {
+        FreeGuarded(ptr);
+        return;
+    }
+
+    AllocBucket *bucket = GetAllocationBucket(ptr);
+    MemoryHeap *heap = bucket->heap;
+
+    // The bucket may be released once the block is freed
+    LockSpinLock(&heap->lock);
+    FreeBucketBlock(bucket, ptr);
+    UnlockSpinLock(&heap->lock);
+}
+
+void *Realloc(void *ptr, size_t new_size)
+{
+    if (ptr == NULL)
+        return Alloc(new_size);
+
+    if (IsGuardedAllocation(ptr))
+        return ReallocGuarded(NULL, ptr, new_size);
+
+    // Memory is always given back to the arena that owns it, so a realloc
+    // that moves the memory allocates from that arena too
+    MemoryHeap *heap = GetAllocationHeap(ptr);
+
+    LockSpinLock(&heap->lock);
+    void *new_ptr = HeapRealloc(heap, ptr, new_size);
+    UnlockSpinLock(&heap->lock);
+
+    return new_ptr;
+}
+
+void Free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    if (IsGuardedAllocation(ptr))
+    {
+        FreeGuarded(ptr);
+        return;
+    }
+
+    MemoryHeap *heap = GetAllocationHeap(ptr);
+
+    // Rather than waiting for a busy heap, leave bucket blocks for its owner to collect
+    if (!TryLockSpinLock(&heap->lock))
+    {
+        if (DeferBucketFree(ptr))
+            return;
+
+        LockSpinLock(&heap->lock);
+    }
+
+    HeapFree(heap, ptr);
+    UnlockSpinLock(&heap->lock);
+}
+
+void DestroyGlobalHeap()
+{
+    LockSpinLock(&global_heap_lock);
+
+    for (int i = 0; i < FT_MALLOC_MAX_ARENAS; i += 1)
+    {
+        if (arenas[i])
+            DestroyHeap(arenas[i]);
+
+        arenas[i] = NULL;
+    }
+
+    global_heap = NULL;
+    ResetThreadCache();
+
+    UnlockSpinLock(&global_heap_lock);
+}
+
+void GetGlobalHeapLayout(HeapLayout *layout)
+{
+    memset(layout, 0, sizeof(HeapLayout));
+
+    for (int i = 0; i < FT_MALLOC_MAX_ARENAS; i += 1)
+    {
+        MemoryHeap *heap = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (!heap)
+            continue;
+
+        LockSpinLock(&heap->lock);
+        AddHeapLayout(heap, layout);
+        UnlockSpinLock(&heap->lock);
+    }
+}
+
+#else
+
+// The global heap itself is not thread safe in this mode,
+// but creating it is, so racing first allocations get the same heap
+static MemoryHeap *GetGlobalHeap()
+{
+    MemoryHeap *heap = __atomic_load_n(&global_heap, __ATOMIC_ACQUIRE);
+    if (heap)
+        return heap;
+
+    LockSpinLock(&global_heap_lock);
+
+    heap = global_heap;
+    if (!heap)
+    {
+        heap = CreateGlobalHeap();
+        if (heap)
+            __atomic_store_n(&global_heap, heap, __ATOMIC_RELEASE);
+        else
+            errno = ENOMEM;
+    }
+
+    UnlockSpinLock(&global_heap_lock);
+
+    return heap;
+}
+
+static void PrepareFork()
+{
+    LockSpinLock(&global_heap_lock);
+    PrepareGuardedFork();
+}
+
+static void ResumeParentAfterFork()
+{
+    ResumeGuardedParentAfterFork();
+    UnlockSpinLock(&global_heap_lock);
+}
+
+static void ResumeChildAfterFork()
+{
+    ResumeGuardedChildAfterFork();
+    global_heap_lock = (SpinLock){};
+}
+
+void *Alloc(size_t size)
+{
+    MemoryHeap *heap = GetGlobalHeap();
+    if (!heap)
+        return NULL;
+
+    return HeapAlloc(heap, size);
+}
+
+int AllocBatch(size_t size, void **ptrs, int count)
+{
+    MemoryHeap *heap = GetGlobalHeap();
+    if (!heap)
+        return 0;
+
+    // Cached blocks lose the allocated pattern, so they are handed out one at a time
+    if (heap->poison_mode == FT_MALLOC_POISON_FULL)
+        count = 1;
+
+    int i = 0;
+    while (i < count && (ptrs[i] = HeapAllocUnsampled(heap, size)) != NULL)
+        i += 1;
+
+    if (malloc_config.guarded_sample_rate != 0 && i > 0)
+        SampleGuardedBatch(heap, size, ptrs, i);
+
+    return i;
+}
+
+void FreeThreadCacheBlock(void *ptr)
+{
+    // Refills may have put a guarded allocation in the cache
+    if (IsGuardedAllocation(ptr))
+    {
+        FreeGuarded(ptr);
+        return;
+    }
+
+    FreeBucketBlock(GetAllocationBucket(ptr), ptr);
+}
+
+// Without a global heap, nothing can have been allocated from it
+void *Realloc(void *ptr, size_t new_size)
+{
+    MemoryHeap *heap = GetGlobalHeap();
+    if (!heap)
+        return NULL;
+
+    return HeapRealloc(heap, ptr, new_size);
+}
+
+void Free(void *ptr)
+{
+    MemoryHeap *heap = GetGlobalHeap();
+    if (heap)
+        HeapFree(heap, ptr);
+}
+
+void DestroyGlobalHeap()
+{
+    LockSpinLock(&global_heap_lock);
+
+    if (global_heap)
+        DestroyHeap(global_heap);
+
+    global_heap = NULL;
+    ResetThreadCache();
+
+    UnlockSpinLock(&global_heap_lock);
+}
+
+void GetGlobalHeapLayout(HeapLayout *layout)
+{
+    memset(layout, 0, sizeof(HeapLayout));
+
+    if (global_heap)
+        AddHeapLayout(global_heap, layout);
+}
+
+#endif
@@ -0,0 +1,379 @@
+#include "malloc_internal.h"
+
+#include <execinfo.h>
+#include <signal.h>
+
+// Sampled allocations are served from a pool of pages that alternate between
+// data pages and PROT_NONE guard pages. Blocks end at the end of their data page,
+// so overflows fault on the next guard page. Freed data pages are protected too,
+// and slots are reused in round robin order, so a freed block stays inaccessible
+// until every other slot has been used.
+
+#define GUARDED_TRACE_DEPTH 16
+
+typedef enum GuardedSlotState
+{
+    GuardedSlot_Unused,
+    GuardedSlot_Allocated,
+    GuardedSlot_Freed,
+} GuardedSlotState;
+
+typedef struct GuardedSlot
+{
+    void *ptr;
+    size_t size;
+    GuardedSlotState state;
+    int alloc_trace_size;
+    int free_trace_size;
+    void *alloc_trace[GUARDED_TRACE_DEPTH];
+    void *free_trace[GUARDED_TRACE_DEPTH];
+} GuardedSlot;
+
+uintptr_t guarded_pool_start;
+size_t guarded_pool_size;
+
+static SpinLock guarded_lock;
+static GuardedSlot *guarded_slots;
+static size_t num_guarded_slots;
+static size_t next_guarded_slot;
+static struct sigaction previous_segv_action;
+
+static uint64_t guarded_seed_counter;
+static __thread uint64_t guarded_random_state;
+__thread uint32_t guarded_sample_countdown __attribute__((tls_model("initial-exec")));
+
+static void *GetGuardedSlotPage(size_t index)
+{
+    return (void *)guarded_pool_start + (index * 2 + 1) * GetPageSize();
+}
+
+static void WriteString(const char *str)
+{
+    size_t n = write(2, str, strlen(str));
+    (void)n;
+}
+
+static void WriteNumber(uint64_t value, int base)
+{
+    char buffer[32];
+    int i = sizeof(buffer);
+    do
+    {
+        buffer[--i] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value);
+
+    if (base == 16)
+    {
+        buffer[--i] = 'x';
+        buffer[--i] = '0';
+    }
+
+    size_t n = write(2, buffer + i, sizeof(buffer) - i);
+    (void)n;
+}
+
+static void ReportGuardedFault(void *addr, GuardedSlot *slot, const char *kind)
+{
+    WriteString("ft_malloc: ");
+    WriteString(kind);
+    WriteString(" at ");
+    WriteNumber((uintptr_t)addr, 16);
+
+    if (slot && slot->state != GuardedSlot_Unused)
+    {
+        WriteString(", ");
+        if (addr < slot->ptr)
+        {
+            WriteNumber(slot->ptr - addr, 10);
+            WriteString(" bytes before");
+        }
+        else if (addr >= slot->ptr + slot->size)
+        {
+            WriteNumber(addr - slot->ptr - slot->size, 10);
+            WriteString(" bytes after");
+        }
+        else
+        {
+            WriteNumber(addr - slot->ptr, 10);
+            WriteString(" bytes inside");
+        }
+
+        WriteString(" a block of ");
+        WriteNumber(slot->size, 10);
+        WriteString(" bytes at ");
+        WriteNumber((uintptr_t)slot->ptr, 16);
+        WriteString("\nAllocated by:\n");
+        backtrace_symbols_fd(slot->alloc_trace, slot->alloc_trace_size, 2);
+
+        if (slot->state == GuardedSlot_Freed)
+        {
+            WriteString("Freed by:\n");
+            backtrace_symbols_fd(slot->free_trace, slot->free_trace_size, 2);
+        }
+    }
+    else
+    {
+        WriteString("\n");
+    }
+
+    WriteString("Faulting access:\n");
+    void *trace[GUARDED_TRACE_DEPTH];
+    backtrace_symbols_fd(trace, backtrace(trace, GUARDED_TRACE_DEPTH), 2);
+}
+
+static void HandleSegv(int signal, siginfo_t *info, void *context)
+{
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    if (addr - guarded_pool_start < guarded_pool_size)
+    {
+        size_t page = (addr - guarded_pool_start) / GetPageSize();
+        if (page % 2 == 1)
+        {
+            GuardedSlot *slot = &guarded_slots[page / 2];
+            ReportGuardedFault((void *)addr, slot, slot->state == GuardedSlot_Freed ? "use after free" : "wild access");
+        }
+        else
+        {
+            // Blocks touch the guard page that follows them, so this is most likely an overflow
+            // of the slot before the guard page, or an underflow of the one after it
+            GuardedSlot *before = page > 0 ? &guarded_slots[page / 2 - 1] : NULL;
+            GuardedSlot *after = page / 2 < num_guarded_slots ? &guarded_slots[page / 2] : NULL;
+            if (before && before->state != GuardedSlot_Unused)
+                ReportGuardedFault((void *)addr, before, "buffer overflow");
+            else if (after && after->state != GuardedSlot_Unused)
+                ReportGuardedFault((void *)addr, after, "buffer underflow");
+            else
+                ReportGuardedFault((void *)addr, NULL, "wild access");
+        }
+
+        // Let the access fault again with the previous handler, which usually terminates the program
+        sigaction(SIGSEGV, &previous_segv_action, NULL);
+        return;
+    }
+
+    if (previous_segv_action.sa_flags & SA_SIGINFO)
+    {
+        previous_segv_action.sa_sigaction(signal, info, context);
+    }
+    else if (previous_segv_action.sa_handler != SIG_DFL && previous_segv_action.sa_handler != SIG_IGN)
+    {
+        previous_segv_action.sa_handler(signal);
+    }
+    else
+    {
+        sigaction(SIGSEGV, &previous_segv_action, NULL);
+    }
+}
+
+// Must be called with guarded_lock held
+static int CreateGuardedPool()
+{
+    size_t num_slots = malloc_config.guarded_slots;
+    size_t pool_size = (num_slots * 2 + 1) * GetPageSize();
+    void *pool = mmap(NULL, pool_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool == MAP_FAILED)
+        return 0;
+
+    size_t slots_size = AlignToPageSize(num_slots * sizeof(GuardedSlot));
+    GuardedSlot *slots = mmap(NULL, slots_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED)
+    {
+        munmap(pool, pool_size);
+        return 0;
+    }
+
+    // backtrace loads libgcc the first time it is called, which allocates with the system malloc
+    void *trace[1];
+    backtrace(trace, 1);
+
+    struct sigaction action = {};
+    action.sa_sigaction = HandleSegv;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_segv_action);
+
+    guarded_slots = slots;
+    num_guarded_slots = num_slots;
+    guarded_pool_start = (uintptr_t)pool;
+    __atomic_store_n(&guarded_pool_size, pool_size, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+// The lock is held across backtrace and mprotect, so a fork could happen while
+// another thread holds it. Called by the fork handlers of the global heap.
+void PrepareGuardedFork()
+{
+    LockSpinLock(&guarded_lock);
+}
+
+void ResumeGuardedParentAfterFork()
+{
+    UnlockSpinLock(&guarded_lock);
+}
+
+void ResumeGuardedChildAfterFork()
+{
+    guarded_lock = (SpinLock){};
+}
+
+// Returns a random number in [1, max], max must not be 0
+static uint32_t RandomInterval(uint32_t max)
+{
+    // Seeded from the address of the thread local state, which is randomized
+    // by ASLR, and a counter that tells apart threads that reuse the same address
+    if (!guarded_random_state)
+    {
+        uint64_t seed = (uintptr_t)&guarded_random_state ^ (__atomic_add_fetch(&guarded_seed_counter, 1, __ATOMIC_RELAXED) * 0x9e3779b97f4a7c15);
+        seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9;
+        seed = (seed ^ (seed >> 27)) * 0x94d049bb133111eb;
+        guarded_random_state = (seed ^ (seed >> 31)) | 1;
+    }
+
+    uint64_t x = guarded_random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    guarded_random_state = x;
+
+    return (uint32_t)(1 + x % max);
+}
+
+// Counts count allocations of the calling thread against the sampling countdown.
+// Returns the index of the allocation to sample, or -1 if none of them is.
+static int CountGuardedSamples(int count)
+{
+    uint64_t rate = malloc_config.guarded_sample_rate;
+
+    // Threads start at a random point of the interval, so their first allocation
+    // is not always sampled
+    if (guarded_sample_countdown == 0)
+        guarded_sample_countdown = RandomInterval(rate);
+
+    if (guarded_sample_countdown > (uint32_t)count)
+    {
+        guarded_sample_countdown -= count;
+        return -1;
+    }
+
+    int index = guarded_sample_countdown - 1;
+
+    // Intervals average to the sample rate, and allocations
+    // that follow the sampled one in the batch count against the next one
+    uint32_t interval = RandomInterval(rate * 2 - 1 < UINT32_MAX ? rate * 2 - 1 : UINT32_MAX);
+    uint32_t remaining = count - index - 1;
+    guarded_sample_countdown = interval > remaining ? interval - remaining : 1;
+
+    return index;
+}
+
+static void *AllocGuarded(size_t size)
+{
+    if (size > GetPageSize())
+        return NULL;
+
+    LockSpinLock(&guarded_lock);
+
+    if (!guarded_pool_start && !CreateGuardedPool())
+    {
+        UnlockSpinLock(&guarded_lock);
+        return NULL;
+    }
+
+    GuardedSlot *slot = NULL;
+    for (size_t i = 0; i < num_guarded_slots && !slot; i += 1)
+    {
+        size_t index = (next_guarded_slot + i) % num_guarded_slots;
+        if (guarded_slots[index].state != GuardedSlot_Allocated)
+        {
+            slot = &guarded_slots[index];
+            next_guarded_slot = index + 1;
+        }
+    }
+
+    void *page = slot ? GetGuardedSlotPage(slot - guarded_slots) : NULL;
+    if (!slot || mprotect(page, GetPageSize(), PROT_READ | PROT_WRITE) != 0)
+    {
+        UnlockSpinLock(&guarded_lock);
+        return NULL;
+    }
+
+    slot->ptr = page + GetPageSize() - AlignNumber(size, FT_MALLOC_ALIGNMENT);
+    slot->size = size;
+    slot->state = GuardedSlot_Allocated;
+    slot->alloc_trace_size = backtrace(slot->alloc_trace, GUARDED_TRACE_DEPTH);
+    slot->free_trace_size = 0;
+
+    UnlockSpinLock(&guarded_lock);
+
+    FT_Probe2(guarded_alloc, slot->ptr, size);
+
+    return slot->ptr;
+}
+
+void *SampleGuardedAllocSlow(size_t size)
+{
+    if (CountGuardedSamples(1) < 0)
+        return NULL;
+
+    return AllocGuarded(size);
+}
+
+void SampleGuardedBatch(MemoryHeap *heap, size_t size, void **ptrs, int count)
+{
+    int index = CountGuardedSamples(count);
+    if (index < 0)
+        return;
+
+    void *ptr = AllocGuarded(size);
+    if (!ptr)
+        return;
+
+    HeapFree(heap, ptrs[index]);
+    ptrs[index] = ptr;
+}
+
+size_t GetGuardedAllocationSize(void *ptr)
+{
+    size_t page = ((uintptr_t)ptr - guarded_pool_start) / GetPageSize();
+
+    return guarded_slots[page / 2].size;
+}
+
+void FreeGuarded(void *ptr)
+{
+    LockSpinLock(&guarded_lock);
+
+    size_t page = ((uintptr_t)ptr - guarded_pool_start) / GetPageSize();
+    GuardedSlot *slot = page % 2 == 1 ? &guarded_slots[page / 2] : NULL;
+    if (!slot || slot->state != GuardedSlot_Allocated || slot->ptr != ptr)
+    {
+        ReportGuardedFault(ptr, slot, slot && slot->state == GuardedSlot_Freed ? "double free" : "invalid free");
+        __builtin_trap();
+    }
+
+    slot->state = GuardedSlot_Freed;
+    slot->free_trace_size = backtrace(slot->free_trace, GUARDED_TRACE_DEPTH);
+    mprotect(GetGuardedSlotPage(slot - guarded_slots), GetPageSize(), PROT_NONE);
+
+    UnlockSpinLock(&guarded_lock);
+}
+
+void *ReallocGuarded(MemoryHeap *heap, void *ptr, size_t new_size)
+{
+    void *new_ptr = NULL;
+    if (new_size > 0)
+    {
+        new_ptr = heap ? HeapAlloc(heap, new_size) : Alloc(new_size);
+        if (!new_ptr)
+            return NULL;
+
+        size_t size = GetGuardedAllocationSize(ptr);
+        CopyMemory(new_ptr, ptr, size < new_size ? size : new_size);
+    }
+
+    FreeGuarded(ptr);
+
+    return new_ptr;
+}
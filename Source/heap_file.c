@@ -0,0 +1,400 @@
+#include "malloc_internal.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define HEAP_FILE_MAGIC 0x5041454854464d46
+#define HEAP_FILE_VERSION 2
+
+static MemoryHeap *GetHeapFileHeap(HeapFile *file)
+{
+    return (MemoryHeap *)AlignPointer(file + 1, 64);
+}
+
+static size_t GetHeapFileHeaderSize()
+{
+    return AlignToPageSize(AlignNumber(sizeof(HeapFile), 64) + sizeof(MemoryHeap));
+}
+
+void *AllocHeapFilePages(HeapFile *file, size_t size)
+{
+    for (FreeExtent **it = &file->free_extents; *it; it = &(*it)->next)
+    {
+        FreeExtent *extent = *it;
+        if (extent->size < size)
+            continue;
+
+        if (extent->size == size)
+        {
+            *it = extent->next;
+        }
+        else
+        {
+            FreeExtent *rest = (void *)extent + size;
+            rest->next = extent->next;
+            rest->size = extent->size - size;
+            *it = rest;
+        }
+
+        *extent = (FreeExtent){};
+
+        return extent;
+    }
+
+    return NULL;
+}
+
+void FreeHeapFilePages(HeapFile *file, void *ptr, size_t size)
+{
+    // Give the pages back to the file system, they read as zero afterwards
+    if (madvise(ptr, size, MADV_REMOVE) != 0)
+        memset(ptr, 0, size);
+
+    FreeExtent *prev = NULL;
+    FreeExtent *next = file->free_extents;
+    while (next && (void *)next < ptr)
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    FreeExtent *extent = ptr;
+    extent->size = size;
+    extent->next = next;
+
+    if (next && ptr + size == (void *)next)
+    {
+        extent->size += next->size;
+        extent->next = next->next;
+        *next = (FreeExtent){};
+    }
+
+    if (prev && (void *)prev + prev->size == ptr)
+    {
+        prev->size += extent->size;
+        prev->next = extent->next;
+        *extent = (FreeExtent){};
+    }
+    else if (prev)
+    {
+        prev->next = extent;
+    }
+    else
+    {
+        file->free_extents = extent;
+    }
+}
+
+static HeapFile *CreateHeapFile(int fd, size_t size, int shared)
+{
+    size_t header_size = GetHeapFileHeaderSize();
+    size = AlignToPageSize(size);
+    if (size <= header_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) != 0)
+        return NULL;
+
+    HeapFile *file = mmap((void *)FT_MALLOC_HEAP_FILE_BASE, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED)
+        return NULL;
+
+    file->magic = HEAP_FILE_MAGIC;
+    file->version = HEAP_FILE_VERSION;
+    file->heap_size = sizeof(MemoryHeap);
+    file->base = file;
+    file->size = size;
+    file->shared = shared;
+
+    if (shared)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        int error = pthread_mutex_init(&file->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        if (error != 0)
+        {
+            munmap(file, size);
+            errno = error;
+            return NULL;
+        }
+    }
+
+    FreeExtent *extent = (void *)file + header_size;
+    extent->size = size - header_size;
+    file->free_extents = extent;
+
+    MemoryHeap *heap = GetHeapFileHeap(file);
+    InitHeap(heap);
+    heap->file = file;
+
+    return file;
+}
+
+static HeapFile *AttachHeapFile(int fd, size_t file_size)
+{
+    HeapFile header;
+    if (pread(fd, &header, sizeof(HeapFile), 0) != sizeof(HeapFile)
+        || header.magic != HEAP_FILE_MAGIC
+        || header.version != HEAP_FILE_VERSION
+        || header.heap_size != sizeof(MemoryHeap)
+        || header.size != file_size
+        || (header.attached && !header.shared))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    HeapFile *file = mmap(header.base, header.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (file == MAP_FAILED)
+        return NULL;
+
+    // Kernels older than 4.17 treat the address as a hint
+    if (file != header.base)
+    {
+        munmap(file, header.size);
+        errno = EEXIST;
+        return NULL;
+    }
+
+    if (file->shared)
+        return file;
+
+    // These only make sense in the process that set them
+    MemoryHeap *heap = GetHeapFileHeap(file);
+    heap->lock = (SpinLock){};
+    heap->numa_node = -1;
+    heap->prefault_flags = 0;
+    heap->pressure_callback = NULL;
+    heap->pressure_callback_data = NULL;
+
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    SetBucketPageMaps(heap, 1);
+#endif
+
+    return file;
+}
+
+static MemoryHeap *CloseHeapFileOnError(int fd)
+{
+    int error = errno;
+    close(fd);
+    errno = error;
+
+    return NULL;
+}
+
+MemoryHeap *CreateHeapFromFile(const char *path, size_t size)
+{
+    LoadMallocConfig();
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+
+    // The lock is released when the file is closed, even if the process crashes
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        errno = EBUSY;
+        return CloseHeapFileOnError(fd);
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+        return CloseHeapFileOnError(fd);
+
+    HeapFile *file;
+    if (file_stat.st_size == 0)
+        file = CreateHeapFile(fd, size, 0);
+    else
+        file = AttachHeapFile(fd, file_stat.st_size);
+
+    if (!file)
+        return CloseHeapFileOnError(fd);
+
+    if (file->shared)
+    {
+        munmap(file, file->size);
+        errno = EINVAL;
+        return CloseHeapFileOnError(fd);
+    }
+
+    file->attached = 1;
+    file->fd = fd;
+
+    return GetHeapFileHeap(file);
+}
+
+void DetachHeapFile(MemoryHeap *heap)
+{
+    HeapFile *file = heap->file;
+
+    // The memory of a shared heap stays around as long as a process maps it
+    if (file->shared)
+    {
+        munmap(file, file->size);
+        return;
+    }
+
+    int fd = file->fd;
+
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    SetBucketPageMaps(heap, 0);
+#endif
+
+    file->attached = 0;
+    msync(file, file->size, MS_SYNC);
+    munmap(file, file->size);
+    close(fd);
+}
+
+void SetHeapRoot(MemoryHeap *heap, void *root)
+{
+    FT_Assert(heap->file != NULL);
+
+    heap->file->root = root;
+}
+
+void *GetHeapRoot(MemoryHeap *heap)
+{
+    FT_Assert(heap->file != NULL);
+
+    return heap->file->root;
+}
+
+MemoryHeap *CreateSharedHeap(size_t size, int *fd)
+{
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    // The page map of each process would only know about its own buckets
+    (void)size;
+    (void)fd;
+    errno = ENOTSUP;
+
+    return NULL;
+#else
+    LoadMallocConfig();
+
+    *fd = memfd_create("ft_malloc", MFD_CLOEXEC);
+    if (*fd < 0)
+        return NULL;
+
+    HeapFile *file = CreateHeapFile(*fd, size, 1);
+    if (!file)
+        return CloseHeapFileOnError(*fd);
+
+    file->attached = 1;
+
+    return GetHeapFileHeap(file);
+#endif
+}
+
+MemoryHeap *AttachSharedHeap(int fd)
+{
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    (void)fd;
+    errno = ENOTSUP;
+
+    return NULL;
+#else
+    LoadMallocConfig();
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+        return NULL;
+
+    HeapFile *file = AttachHeapFile(fd, file_stat.st_size);
+    if (!file)
+        return NULL;
+
+    if (!file->shared)
+    {
+        munmap(file, file->size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return GetHeapFileHeap(file);
+#endif
+}
+
+// Returns 0 if the lock could not be taken. A process that died while holding it may
+// have left the heap in the middle of an update, so the lock is not made consistent
+// again. Unlocking it then makes it unusable, and every process gets ENOTRECOVERABLE.
+static int LockSharedHeap(MemoryHeap *heap)
+{
+    FT_Assert(heap->file != NULL && heap->file->shared);
+
+    int error = pthread_mutex_lock(&heap->file->lock);
+    if (error == EOWNERDEAD)
+    {
+        pthread_mutex_unlock(&heap->file->lock);
+        error = ENOTRECOVERABLE;
+    }
+
+    if (error != 0)
+    {
+        errno = error;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void UnlockSharedHeap(MemoryHeap *heap)
+{
+    pthread_mutex_unlock(&heap->file->lock);
+}
+
+void *SharedHeapAlloc(MemoryHeap *heap, size_t size)
+{
+    if (!LockSharedHeap(heap))
+        return NULL;
+
+    void *ptr = HeapAlloc(heap, size);
+    UnlockSharedHeap(heap);
+
+    return ptr;
+}
+
+void *SharedHeapRealloc(MemoryHeap *heap, void *ptr, size_t new_size)
+{
+    if (!LockSharedHeap(heap))
+        return NULL;
+
+    void *new_ptr = HeapRealloc(heap, ptr, new_size);
+    UnlockSharedHeap(heap);
+
+    return new_ptr;
+}
+
+// Memory is leaked if the heap cannot be used anymore
+void SharedHeapFree(MemoryHeap *heap, void *ptr)
+{
+    if (!LockSharedHeap(heap))
+        return;
+
+    HeapFree(heap, ptr);
+    UnlockSharedHeap(heap);
+}
+
+size_t GetHeapOffset(MemoryHeap *heap, void *ptr)
+{
+    FT_Assert(heap->file != NULL);
+    FT_Assert(ptr >= (void *)heap->file && ptr < (void *)heap->file + heap->file->size);
+
+    return ptr - (void *)heap->file;
+}
+
+void *GetHeapPointer(MemoryHeap *heap, size_t offset)
+{
+    FT_Assert(heap->file != NULL);
+    FT_Assert(offset < heap->file->size);
+
+    return (void *)heap->file + offset;
+}
@@ -0,0 +1,190 @@
+#include "malloc_internal.h"
+
+static void AddBucketLayout(AllocBucket *bucket, SizeClassLayout *size_class, HeapLayout *layout)
+{
+    size_t used_bytes = bucket->alloc_size * bucket->num_allocations;
+    size_t free_bytes = bucket->alloc_size * (bucket->alloc_capacity - bucket->num_allocations);
+
+    size_class->num_buckets += 1;
+    size_class->capacity += bucket->alloc_capacity;
+    size_class->num_allocations += bucket->num_allocations;
+    size_class->requested_bytes += bucket->requested_bytes;
+    size_class->wasted_bytes += used_bytes - bucket->requested_bytes;
+    size_class->mapped_bytes += bucket->mapped_size;
+
+    layout->num_buckets += 1;
+    layout->num_bucket_allocations += bucket->num_allocations;
+    layout->bucket_requested_bytes += bucket->requested_bytes;
+    layout->bucket_wasted_bytes += used_bytes - bucket->requested_bytes;
+    layout->bucket_mapped_bytes += bucket->mapped_size;
+
+    if (bucket->num_allocations == 0)
+    {
+        size_class->num_empty_buckets += 1;
+        size_class->empty_bucket_bytes += bucket->mapped_size;
+
+        layout->num_empty_buckets += 1;
+        layout->bucket_empty_bytes += bucket->mapped_size;
+    }
+    else
+    {
+        layout->bucket_free_bytes += free_bytes;
+    }
+}
+
+static void AddSpanChunkLayout(SpanChunk *chunk, HeapLayout *layout)
+{
+    size_t used_pages = FT_MALLOC_SPAN_CHUNK_USABLE_PAGES - chunk->num_free_pages;
+    size_t used_bytes = used_pages * FT_MALLOC_SPAN_PAGE_SIZE - chunk->num_allocations * sizeof(AllocHeader);
+
+    layout->num_span_chunks += 1;
+    layout->num_span_allocations += chunk->num_allocations;
+    layout->span_requested_bytes += chunk->requested_bytes;
+    layout->span_wasted_bytes += used_bytes - chunk->requested_bytes;
+    layout->span_free_bytes += chunk->num_free_pages * FT_MALLOC_SPAN_PAGE_SIZE;
+    layout->span_mapped_bytes += FT_MALLOC_SPAN_CHUNK_SIZE;
+}
+
+static size_t GetLargestFreeSpanSize(MemoryHeap *heap)
+{
+    for (int word = FT_MALLOC_NUM_FREE_SPAN_LISTS / 64 - 1; word >= 0; word -= 1)
+    {
+        uint64_t mask = heap->free_span_mask[word];
+        if (!mask)
+            continue;
+
+        int list = word * 64 + 63 - __builtin_clzll(mask);
+        size_t num_pages = 0;
+        for (AllocHeader *span = heap->free_spans[list]; span; span = span->next)
+        {
+            if (span->size > num_pages)
+                num_pages = span->size;
+        }
+
+        return num_pages * FT_MALLOC_SPAN_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+void AddHeapLayout(MemoryHeap *heap, HeapLayout *layout)
+{
+    for (int i = 0; i < FT_MALLOC_NUM_SIZE_CLASS; i += 1)
+    {
+        SizeClassLayout *size_class = &layout->size_classes[i];
+        size_class->alloc_size = FT_MALLOC_MIN_SIZE + i * FT_MALLOC_SMALL_SIZE_GRANULARITY;
+
+        for (AllocBucket *bucket = heap->buckets_per_size_class[i]; bucket; bucket = bucket->next)
+            AddBucketLayout(bucket, size_class, layout);
+    }
+
+    for (SpanChunk *chunk = heap->span_chunks; chunk; chunk = chunk->next)
+        AddSpanChunkLayout(chunk, layout);
+
+    size_t largest_free_span = GetLargestFreeSpanSize(heap);
+    if (largest_free_span > layout->span_largest_free_bytes)
+        layout->span_largest_free_bytes = largest_free_span;
+
+    layout->num_big_allocations += heap->num_big_allocations;
+    layout->big_requested_bytes += heap->big_requested_bytes;
+    layout->big_wasted_bytes += heap->big_mapped_bytes - heap->big_requested_bytes - heap->num_big_allocations * sizeof(BigAllocHeader);
+    layout->big_mapped_bytes += heap->big_mapped_bytes;
+    layout->num_big_cached += heap->num_big_cached;
+    layout->big_cached_bytes += heap->big_cached_bytes;
+    layout->num_movable_handles += heap->num_movable_handles;
+    layout->num_movable_handle_blocks += heap->num_movable_handle_blocks;
+    layout->movable_handle_mapped_bytes += heap->num_movable_handle_blocks * GetPageSize();
+
+    // Totals are recomputed from the per kind values, so adding
+    // several heaps to the same layout stays consistent
+    layout->num_heaps += 1;
+    layout->num_mappings = layout->num_heaps + layout->num_buckets + layout->num_span_chunks
+        + layout->num_big_allocations + layout->num_big_cached + layout->num_movable_handle_blocks;
+    layout->num_allocations = layout->num_bucket_allocations + layout->num_span_allocations + layout->num_big_allocations;
+    layout->requested_bytes = layout->bucket_requested_bytes + layout->span_requested_bytes + layout->big_requested_bytes;
+    layout->mapped_bytes = layout->num_heaps * AlignToPageSize(sizeof(MemoryHeap))
+        + layout->bucket_mapped_bytes + layout->span_mapped_bytes + layout->big_mapped_bytes + layout->big_cached_bytes
+        + layout->movable_handle_mapped_bytes;
+}
+
+void GetHeapLayout(MemoryHeap *heap, HeapLayout *layout)
+{
+    memset(layout, 0, sizeof(HeapLayout));
+    AddHeapLayout(heap, layout);
+}
+
+static double GetPercentage(size_t value, size_t total)
+{
+    if (total == 0)
+        return 0;
+
+    return value * 100.0 / total;
+}
+
+void PrintHeapLayout(const HeapLayout *layout)
+{
+    printf("Heap layout: %lu heaps, %lu mappings, %lu bytes mapped, %lu allocations, %lu bytes requested (%.1f%% of mapped)\n",
+        layout->num_heaps, layout->num_mappings, layout->mapped_bytes,
+        layout->num_allocations, layout->requested_bytes, GetPercentage(layout->requested_bytes, layout->mapped_bytes));
+
+    printf("Buckets: %lu buckets (%lu empty), %lu allocations, %lu bytes mapped\n",
+        layout->num_buckets, layout->num_empty_buckets, layout->num_bucket_allocations, layout->bucket_mapped_bytes);
+    printf("  requested=%lu wasted=%lu free=%lu empty=%lu\n",
+        layout->bucket_requested_bytes, layout->bucket_wasted_bytes, layout->bucket_free_bytes, layout->bucket_empty_bytes);
+
+    if (layout->num_buckets > 0)
+    {
+        printf("  %8s %8s %8s %10s %10s %12s %10s %12s\n",
+            "size", "buckets", "empty", "capacity", "allocs", "requested", "wasted", "mapped");
+    }
+
+    for (int i = 0; i < FT_MALLOC_NUM_SIZE_CLASS; i += 1)
+    {
+        const SizeClassLayout *size_class = &layout->size_classes[i];
+        if (size_class->num_buckets == 0)
+            continue;
+
+        printf("  %8lu %8lu %8lu %10lu %10lu %12lu %10lu %12lu\n",
+            size_class->alloc_size, size_class->num_buckets, size_class->num_empty_buckets,
+            size_class->capacity, size_class->num_allocations, size_class->requested_bytes,
+            size_class->wasted_bytes, size_class->mapped_bytes);
+    }
+
+    printf("Spans: %lu chunks, %lu allocations, %lu bytes mapped\n",
+        layout->num_span_chunks, layout->num_span_allocations, layout->span_mapped_bytes);
+    printf("  requested=%lu wasted=%lu free=%lu largest_free=%lu\n",
+        layout->span_requested_bytes, layout->span_wasted_bytes, layout->span_free_bytes, layout->span_largest_free_bytes);
+
+    printf("Big: %lu allocations, %lu bytes mapped\n", layout->num_big_allocations, layout->big_mapped_bytes);
+    printf("  requested=%lu wasted=%lu cached=%lu (%lu bytes)\n",
+        layout->big_requested_bytes, layout->big_wasted_bytes, layout->num_big_cached, layout->big_cached_bytes);
+
+    if (layout->num_movable_handle_blocks > 0)
+    {
+        printf("Movable handles: %lu handles in %lu blocks, %lu bytes mapped\n",
+            layout->num_movable_handles, layout->num_movable_handle_blocks, layout->movable_handle_mapped_bytes);
+    }
+}
+
+AllocationStats GetAllocationStats()
+{
+    HeapLayout layout;
+    GetGlobalHeapLayout(&layout);
+
+    AllocationStats stats = {};
+    stats.num_allocated_bytes = layout.requested_bytes;
+    stats.num_allocation_buckets = layout.num_buckets;
+    stats.num_allocations = layout.num_allocations;
+    stats.num_bucket_allocations = layout.num_bucket_allocations;
+    stats.num_span_allocations = layout.num_span_allocations;
+    stats.num_big_allocations = layout.num_big_allocations;
+
+    return stats;
+}
+
+void PrintAllocationState()
+{
+    HeapLayout layout;
+    GetGlobalHeapLayout(&layout);
+    PrintHeapLayout(&layout);
+}
@@ -12,29 +12,70 @@ size_t GetPageSize()
 
 MemoryHeap *CreateHeap()
 {
+    LoadMallocConfig();
+
     MemoryHeap *heap = mmap(NULL, sizeof(MemoryHeap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    memset(heap, 0, sizeof(MemoryHeap));
+    if (heap == MAP_FAILED)
+        return NULL;
+
+    InitHeap(heap);
 
     return heap;
 }
 
+void InitHeap(MemoryHeap *heap)
+{
+    memset(heap, 0, sizeof(MemoryHeap));
+    heap->numa_node = -1;
+    heap->big_cache_capacity = malloc_config.big_cache_capacity;
+    heap->big_cache_max_size = malloc_config.big_cache_max_size;
+    heap->poison_mode = malloc_config.poison_mode;
+}
+
 void DestroyHeap(MemoryHeap *heap)
 {
+    if (heap->file)
+    {
+        DetachHeapFile(heap);
+        return;
+    }
+
+    CleanupMovableHandles(heap);
     CleanupBigAllocations(heap);
     CleanupBucketAllocations(heap);
+    CleanupSpanAllocations(heap);
     munmap((void *)heap, sizeof(MemoryHeap));
 }
 
 void *HeapAlloc(MemoryHeap *heap, size_t size)
+{
+    // Heap files may outlive the guarded pool, which only exists in this process
+    if (malloc_config.guarded_sample_rate != 0 && size != 0 && !heap->file)
+    {
+        void *ptr = SampleGuardedAlloc(size);
+        if (ptr)
+            return ptr;
+    }
+
+    return HeapAllocUnsampled(heap, size);
+}
+
+void *HeapAllocUnsampled(MemoryHeap *heap, size_t size)
 {
     if (size > FT_MALLOC_MAX_SIZE)
+    {
+        errno = ENOMEM;
         return NULL;
+    }
     if (size == 0)
         return NULL;
 
     if (size >= FT_MALLOC_MIN_BIG_SIZE)
         return AllocBig(heap, size);
 
+    if (size >= FT_MALLOC_MIN_MID_SIZE)
+        return SpanAlloc(heap, size);
+
     return BucketAlloc(heap, size);
 }
 
@@ -55,11 +96,18 @@ void *HeapRealloc(MemoryHeap *heap, void *ptr, size_t new_size)
     if (ptr == NULL)
         return HeapAlloc(heap, new_size);
 
+    if (IsGuardedAllocation(ptr))
+        return ReallocGuarded(heap, ptr, new_size);
+
+    if (GetAllocationBucket(ptr) != NULL)
+        return BucketRealloc(heap, ptr, new_size);
+
     AllocHeader *header = (AllocHeader *)ptr - 1;
-    if (header->bucket == NULL)
+
+    if (header->size >= FT_MALLOC_MIN_BIG_SIZE)
         return ReallocBig(heap, ptr, new_size);
 
-    return BucketRealloc(heap, ptr, new_size);
+    return SpanRealloc(heap, ptr, new_size);
 }
 
 void HeapFree(MemoryHeap *heap, void *ptr)
@@ -67,42 +115,264 @@ void HeapFree(MemoryHeap *heap, void *ptr)
     if (ptr == NULL)
         return;
 
+    if (IsGuardedAllocation(ptr))
+    {
+        FreeGuarded(ptr);
+        return;
+    }
+
+    // Span and big allocations have no bucket, they are told apart by their size
     AllocHeader *header = (AllocHeader *)ptr - 1;
-    if (header->bucket == NULL)
+    if (GetAllocationBucket(ptr) != NULL)
+        BucketFree(heap, ptr);
+    else if (header->size >= FT_MALLOC_MIN_BIG_SIZE)
         FreeBig(heap, ptr);
     else
-        BucketFree(heap, ptr);
+        SpanFree(heap, ptr);
+}
+
+int HeapReserve(MemoryHeap *heap, size_t size, size_t count)
+{
+    if (size == 0 || size > FT_MALLOC_MAX_SIZE)
+        return -1;
+
+    if (size >= FT_MALLOC_MIN_BIG_SIZE)
+        return ReserveBig(heap, size, count);
+
+    if (size >= FT_MALLOC_MIN_MID_SIZE)
+        return ReserveSpans(heap, size, count);
+
+    return ReserveBuckets(heap, size, count);
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+static int PrefaultMemory(void *ptr, size_t size, int flags)
+{
+    // MADV_POPULATE_WRITE needs Linux 5.14, otherwise write to every page ourselves
+    if (madvise(ptr, size, MADV_POPULATE_WRITE) != 0)
+    {
+        for (size_t offset = 0; offset < size; offset += GetPageSize())
+        {
+            volatile char *byte = (char *)ptr + offset;
+            *byte = *byte;
+        }
+    }
+
+    if (flags & FT_MALLOC_PREFAULT_LOCK)
+        return mlock(ptr, size);
+
+    return 0;
+}
+
+int HeapPrefault(MemoryHeap *heap, int flags)
+{
+    int result = PrefaultMemory(heap, AlignToPageSize(sizeof(MemoryHeap)), flags);
+
+    for (int i = 0; i < FT_MALLOC_NUM_SIZE_CLASS; i += 1)
+    {
+        for (AllocBucket *bucket = heap->buckets_per_size_class[i]; bucket; bucket = bucket->next)
+            result |= PrefaultMemory(bucket, bucket->mapped_size, flags);
+    }
+
+    for (SpanChunk *chunk = heap->span_chunks; chunk; chunk = chunk->next)
+        result |= PrefaultMemory(chunk, FT_MALLOC_SPAN_CHUNK_SIZE, flags);
+
+    for (AllocHeader *header = heap->big_allocs; header; header = header->next)
+    {
+        BigAllocHeader *big_header = GetBigAllocHeader(header);
+        result |= PrefaultMemory(big_header, big_header->mapped_size, flags);
+    }
+
+    for (AllocHeader *header = heap->big_cache; header; header = header->next)
+    {
+        BigAllocHeader *big_header = GetBigAllocHeader(header);
+        result |= PrefaultMemory(big_header, big_header->mapped_size, flags);
+    }
+
+    if (flags & FT_MALLOC_PREFAULT_NEW_MEMORY)
+        heap->prefault_flags = flags;
+    else
+        heap->prefault_flags = 0;
+
+    return result == 0 ? 0 : -1;
+}
+
+void SetHeapPoisonMode(MemoryHeap *heap, int mode)
+{
+    FT_Assert(mode >= FT_MALLOC_POISON_OFF && mode <= FT_MALLOC_POISON_FULL);
+
+    heap->poison_mode = mode;
 }
 
-MemoryHeap *global_heap;
+void SetHeapLimits(MemoryHeap *heap, size_t soft_limit, size_t hard_limit)
+{
+    heap->soft_limit = soft_limit;
+    heap->hard_limit = hard_limit;
+}
 
-void *Alloc(size_t size)
+int SetHeapPressureCallback(MemoryHeap *heap, HeapPressureCallback callback, void *data)
 {
-    if (!global_heap)
-        global_heap = CreateHeap();
+    if (heap->file && heap->file->shared)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
 
-    return HeapAlloc(global_heap, size);
+    heap->pressure_callback = callback;
+    heap->pressure_callback_data = data;
+
+    return 0;
 }
 
-void *Realloc(void *ptr, size_t new_size)
+size_t HeapTrim(MemoryHeap *heap)
 {
-    if (!global_heap)
-        global_heap = CreateHeap();
+    size_t mapped_bytes = heap->mapped_bytes;
+    TrimBuckets(heap);
+    TrimSpans(heap);
+    TrimBigCache(heap);
 
-    return HeapRealloc(global_heap, ptr, new_size);
+    return mapped_bytes - heap->mapped_bytes;
 }
 
-void Free(void *ptr)
+// Returns whether size more bytes can be mapped
+static int CheckHeapLimits(MemoryHeap *heap, size_t size)
 {
-    if (!global_heap)
-        global_heap = CreateHeap();
+    if (heap->soft_limit && heap->mapped_bytes + size > heap->soft_limit)
+    {
+        HeapTrim(heap);
+
+        if (heap->pressure_callback && heap->mapped_bytes + size > heap->soft_limit)
+            heap->pressure_callback(heap, heap->mapped_bytes + size, heap->pressure_callback_data);
+    }
 
-    HeapFree(global_heap, ptr);
+    if (heap->hard_limit && heap->mapped_bytes + size > heap->hard_limit)
+    {
+        HeapTrim(heap);
+
+        if (heap->mapped_bytes + size > heap->hard_limit)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void UnmapPages(MemoryHeap *heap, void *ptr, size_t size)
+{
+    if (heap->file)
+        FreeHeapFilePages(heap->file, ptr, size);
+    else
+        munmap(ptr, size);
 }
 
-void DestroyGlobalHeap()
+void *MapHeapMemory(MemoryHeap *heap, size_t size)
 {
-    DestroyHeap(global_heap);
+    return MapHeapMemoryAligned(heap, size, GetPageSize());
+}
+
+void *MapHeapMemoryAligned(MemoryHeap *heap, size_t size, size_t alignment)
+{
+    if (!CheckHeapLimits(heap, size))
+    {
+        FT_Probe2(hard_limit, heap, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // We map enough to find an aligned range and unmap what is outside of it
+    size_t map_size = alignment > GetPageSize() ? size + alignment : size;
+
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifndef FT_MALLOC_NUMA_AWARE
+    // Memory bound to a NUMA node is populated once it is bound instead,
+    // and over mapped memory once it is trimmed
+    if (heap->prefault_flags && map_size == size)
+        map_flags |= MAP_POPULATE;
+#endif
+
+    FT_Probe2(map_start, heap, size);
+
+    void *map;
+    if (heap->file)
+    {
+        map = AllocHeapFilePages(heap->file, map_size);
+        if (!map)
+            errno = ENOMEM;
+    }
+    else
+    {
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+    }
+
+    void *ptr = NULL;
+    if (map)
+    {
+        ptr = AlignPointer(map, alignment);
+        size_t head_size = ptr - map;
+        size_t tail_size = map_size - head_size - size;
+        if (head_size > 0)
+            UnmapPages(heap, map, head_size);
+        if (tail_size > 0)
+            UnmapPages(heap, ptr + size, tail_size);
+    }
+
+    FT_Probe3(map_done, heap, ptr, size);
+
+    if (!ptr)
+        return NULL;
+
+    heap->mapped_bytes += size;
+
+    // Pages taken from a heap file were not mapped with MAP_POPULATE
+    if (heap->file)
+    {
+        if (heap->prefault_flags)
+            PrefaultMemory(ptr, size, heap->prefault_flags);
+
+        return ptr;
+    }
+
+#ifdef FT_MALLOC_NUMA_AWARE
+    BindMemoryToNumaNode(ptr, size, heap->numa_node);
+
+    if (heap->prefault_flags)
+        PrefaultMemory(ptr, size, heap->prefault_flags);
+#else
+    if (heap->prefault_flags && map_size != size)
+        PrefaultMemory(ptr, size, heap->prefault_flags);
+    // Locking is best effort here, HeapPrefault already reported whether it is allowed
+    else if (heap->prefault_flags & FT_MALLOC_PREFAULT_LOCK)
+        mlock(ptr, size);
+#endif
+
+    return ptr;
+}
+
+void UnmapHeapMemory(MemoryHeap *heap, void *ptr, size_t size)
+{
+    FT_Probe3(unmap, heap, ptr, size);
+
+    heap->mapped_bytes -= size;
+    UnmapPages(heap, ptr, size);
+}
+
+MemoryHeap *GetAllocationHeap(void *ptr)
+{
+    AllocBucket *bucket = GetAllocationBucket(ptr);
+    if (bucket != NULL)
+        return bucket->heap;
+
+    AllocHeader *header = (AllocHeader *)ptr - 1;
+
+    if (header->size >= FT_MALLOC_MIN_BIG_SIZE)
+        return GetBigAllocHeader(header)->heap;
+
+    return GetSpanChunk(header)->heap;
 }
 
 static inline void VerifyList(ListNode *list)
@@ -177,12 +447,3 @@ void ListNodePop(ListNode **list_front, ListNode *node)
         VerifyList(*list_front);
 #endif
 }
-
-AllocationStats GetAllocationStats()
-{
-    return (AllocationStats){};
-}
-
-void PrintAllocationState()
-{
-}
@@ -1,6 +1,10 @@
 #ifndef FT_MALLOC_INTERNAL_H
 #define FT_MALLOC_INTERNAL_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "../malloc.h"
 
 #include <string.h>
@@ -8,6 +12,11 @@
 #include <unistd.h>
 #include <time.h>
 #include <stdio.h>
+#include <sched.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "probes.h"
 
 #define FT_Stringify(x) FT_Stringify2(x)
 #define FT_Stringify2(x) #x
@@ -35,6 +44,30 @@
 #define FT_DebugLog(...)
 #endif
 
+typedef struct SpinLock
+{
+    int locked;
+} SpinLock;
+
+static inline void LockSpinLock(SpinLock *lock)
+{
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+            sched_yield();
+    }
+}
+
+static inline int TryLockSpinLock(SpinLock *lock)
+{
+    return !__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void UnlockSpinLock(SpinLock *lock)
+{
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
 typedef struct ListNode
 {
     struct ListNode *prev;
@@ -51,10 +84,26 @@ typedef struct AllocBucket
 {
     struct AllocBucket *prev;
     struct AllocBucket *next;
-    size_t alloc_capacity;
+    struct MemoryHeap *heap;
+    uint32_t alloc_capacity;
+    uint32_t num_allocations;
     size_t alloc_size;
+    // Free blocks are kept in singly linked lists, in the style of mimalloc.
+    // Allocations pop free_blocks, frees push to local_free_blocks, and frees
+    // that could not take the heap's lock push to deferred_free_blocks atomically.
+    // Both are only moved to free_blocks when it runs out, so consecutive
+    // allocations come from blocks that are next to each other.
+    // Deferred blocks are counted as allocated until they are moved.
     struct AllocHeader *free_blocks;
-    struct AllocHeader *occupied_blocks;
+    struct AllocHeader *local_free_blocks;
+    struct AllocHeader *deferred_free_blocks;
+    size_t mapped_size;
+    size_t requested_bytes;
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    // Start of the pages that only contain user data
+    void *data;
+    size_t padding;
+#endif
 } AllocBucket;
 
 static_assert(sizeof(AllocBucket) % 16 == 0, "AllocBucket is not aligned to 16 bytes");
@@ -69,16 +118,227 @@ typedef struct AllocHeader
 
 static_assert(sizeof(AllocHeader) % 16 == 0, "AllocHeader is not aligned to 16 bytes");
 
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+void SetPageMapRange(void *start, size_t size, AllocBucket *bucket);
+AllocBucket *LookupPageMap(void *ptr);
+#endif
+
+// Returns the bucket ptr was allocated from, or NULL for span and big allocations
+static inline AllocBucket *GetAllocationBucket(void *ptr)
+{
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    return LookupPageMap(ptr);
+#else
+    return ((AllocHeader *)ptr - 1)->bucket;
+#endif
+}
+
+// With out-of-line metadata the headers of a bucket are packed in an array
+// that follows the bucket, and the user data lives in separate pages.
+// Otherwise each header directly precedes its block of user data.
+static inline AllocHeader *GetBucketHeader(AllocBucket *bucket, size_t index)
+{
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    return (AllocHeader *)(bucket + 1) + index;
+#else
+    return (AllocHeader *)((void *)(bucket + 1) + index * (sizeof(AllocHeader) + bucket->alloc_size));
+#endif
+}
+
+static inline AllocHeader *GetBucketBlockHeader(AllocBucket *bucket, void *ptr)
+{
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    return GetBucketHeader(bucket, (ptr - bucket->data) / bucket->alloc_size);
+#else
+    (void)bucket;
+    return (AllocHeader *)ptr - 1;
+#endif
+}
+
+static inline void *GetBucketBlockData(AllocBucket *bucket, AllocHeader *header)
+{
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+    return bucket->data + (header - (AllocHeader *)(bucket + 1)) * bucket->alloc_size;
+#else
+    (void)bucket;
+    return (void *)(header + 1);
+#endif
+}
+
+// Big allocations keep a pointer to their heap and the size of their mapping
+// in front of their header, since the size of the allocation can shrink in place
+typedef struct BigAllocHeader
+{
+    struct MemoryHeap *heap;
+    size_t mapped_size;
+    AllocHeader header;
+} BigAllocHeader;
+
+static_assert(sizeof(BigAllocHeader) % 16 == 0, "BigAllocHeader is not aligned to 16 bytes");
+
+static inline BigAllocHeader *GetBigAllocHeader(AllocHeader *header)
+{
+    return (BigAllocHeader *)((void *)header - offsetof(BigAllocHeader, header));
+}
+
+#define FT_MALLOC_SPAN_PAGES_PER_CHUNK (FT_MALLOC_SPAN_CHUNK_SIZE / FT_MALLOC_SPAN_PAGE_SIZE)
+
+// Free spans are kept in lists indexed by their page count, the last list holds
+// every free span that is at least FT_MALLOC_NUM_FREE_SPAN_LISTS pages long
+#define FT_MALLOC_NUM_FREE_SPAN_LISTS 256
+
+static_assert(FT_MALLOC_NUM_FREE_SPAN_LISTS % 64 == 0, "FT_MALLOC_NUM_FREE_SPAN_LISTS must be a multiple of 64");
+
+// The first and last entries of page_runs for a span hold its page count,
+// with the high bit set if the span is free
+#define FT_MALLOC_SPAN_FREE_BIT 0x8000
+
+typedef struct SpanChunk
+{
+    struct SpanChunk *prev;
+    struct SpanChunk *next;
+    struct MemoryHeap *heap;
+    size_t num_free_pages;
+    size_t num_allocations;
+    size_t requested_bytes;
+    uint16_t page_runs[FT_MALLOC_SPAN_PAGES_PER_CHUNK];
+} SpanChunk;
+
+static_assert(sizeof(SpanChunk) % 16 == 0, "SpanChunk is not aligned to 16 bytes");
+
+#define FT_MALLOC_SPAN_CHUNK_HEADER_PAGES ((sizeof(SpanChunk) + FT_MALLOC_SPAN_PAGE_SIZE - 1) / FT_MALLOC_SPAN_PAGE_SIZE)
+#define FT_MALLOC_SPAN_CHUNK_USABLE_PAGES (FT_MALLOC_SPAN_PAGES_PER_CHUNK - FT_MALLOC_SPAN_CHUNK_HEADER_PAGES)
+
+// Handles can not move, so they are kept out of the buckets compaction empties.
+// They are allocated from page sized blocks, free handles have a NULL ptr.
+typedef struct MovableAllocation
+{
+    void *ptr;
+    union
+    {
+        size_t pin_count;
+        struct MovableAllocation *next_free;
+    };
+} MovableAllocation;
+
+typedef struct MovableHandleBlock
+{
+    struct MovableHandleBlock *prev;
+    struct MovableHandleBlock *next;
+    MovableAllocation *free_handles;
+    uint32_t num_handles;
+    uint32_t capacity;
+    MovableAllocation handles[];
+} MovableHandleBlock;
+
+// Free pages of a heap file are kept in a list of extents sorted by address.
+// Each extent starts with its header, the rest of its bytes read as zero.
+typedef struct FreeExtent
+{
+    struct FreeExtent *next;
+    size_t size;
+} FreeExtent;
+
+// Start of the mapping of a heap created with CreateHeapFromFile, followed by the
+// MemoryHeap and the pages it maps memory from. The mapping always lives at the same
+// address, so the pointers stored in the file stay valid when it is attached again.
+typedef struct HeapFile
+{
+    uint64_t magic;
+    uint32_t version;
+    // Set while a process has the heap attached. A heap that was not detached
+    // may have been left in the middle of an update and is never attached again.
+    // Shared heaps can be attached by any number of processes.
+    uint32_t attached;
+    uint32_t shared;
+    size_t heap_size;
+    void *base;
+    size_t size;
+    void *root;
+    FreeExtent *free_extents;
+    // Only used by heaps that are not shared, the descriptor is different in each process
+    int fd;
+    // Only used by shared heaps. It is process shared and robust, so a process that dies
+    // while holding it does not block the others, but the heap is not used again.
+    pthread_mutex_t lock;
+} HeapFile;
+
+// Allocations store the size that was requested in their header, and buckets,
+// chunks and heaps keep running totals so a layout report never has to walk
+// individual allocations.
+// A heap is not thread safe by itself. When FT_MALLOC_PER_CPU_ARENAS is defined
+// the global allocation functions use one heap per CPU, each protected by its lock.
 typedef struct MemoryHeap
 {
+    SpinLock lock;
+    // Set if the heap and all of its memory live in a file
+    HeapFile *file;
+    int numa_node;
+    // Flags given to HeapPrefault with FT_MALLOC_PREFAULT_NEW_MEMORY
+    int prefault_flags;
+    int poison_mode;
+    // Bytes mapped through MapHeapMemory, checked against the limits set with SetHeapLimits
+    size_t mapped_bytes;
+    size_t soft_limit;
+    size_t hard_limit;
+    HeapPressureCallback pressure_callback;
+    void *pressure_callback_data;
+#ifdef FT_MALLOC_USDT_PROBES
+    uint64_t probe_sample_counter;
+#endif
     AllocHeader *big_allocs;
+    size_t num_big_allocations;
+    size_t big_requested_bytes;
+    size_t big_mapped_bytes;
+    // Freed big allocations kept mapped for HeapReserve and FT_MALLOC_CONF
+    AllocHeader *big_cache;
+    size_t num_big_cached;
+    size_t big_cached_bytes;
+    size_t big_cache_capacity;
+    size_t big_cache_max_size;
+    size_t reserved_big_count;
+    size_t reserved_big_size;
     AllocBucket *buckets_per_size_class[FT_MALLOC_NUM_SIZE_CLASS];
+    uint32_t bucket_capacities[FT_MALLOC_NUM_SIZE_CLASS];
+    uint32_t num_empty_buckets[FT_MALLOC_NUM_SIZE_CLASS];
+    uint32_t reserved_blocks[FT_MALLOC_NUM_SIZE_CLASS];
+    // Blocks with free handles, and blocks that are full
+    MovableHandleBlock *movable_handle_blocks;
+    MovableHandleBlock *full_movable_handle_blocks;
+    size_t num_movable_handle_blocks;
+    size_t num_movable_handles;
+    size_t reserved_span_pages;
+    SpanChunk *span_chunks;
+    uint64_t free_span_mask[FT_MALLOC_NUM_FREE_SPAN_LISTS / 64];
+    AllocHeader *free_spans[FT_MALLOC_NUM_FREE_SPAN_LISTS];
 } MemoryHeap;
 
+// All the memory of a heap is mapped through these, so it is bound to the heap's
+// NUMA node when FT_MALLOC_NUMA_AWARE is defined and it counts towards its limits.
+// MapHeapMemory returns NULL and sets errno when the memory could not be mapped.
+// MapHeapMemoryAligned aligns the memory to a multiple of the page size, only the
+// size bytes that are kept count towards the limits.
+void *MapHeapMemory(MemoryHeap *heap, size_t size);
+void *MapHeapMemoryAligned(MemoryHeap *heap, size_t size, size_t alignment);
+void UnmapHeapMemory(MemoryHeap *heap, void *ptr, size_t size);
+
+MemoryHeap *GetAllocationHeap(void *ptr);
+
+#ifdef FT_MALLOC_PER_CPU_ARENAS
+int GetCurrentCpu();
+#endif
+
+#ifdef FT_MALLOC_NUMA_AWARE
+int GetCurrentNumaNode();
+void BindMemoryToNumaNode(void *ptr, size_t size, int node);
+#endif
+
 void *AllocBig(MemoryHeap *heap, size_t size);
 void *ReallocBig(MemoryHeap *heap, void *ptr, size_t new_size);
 void FreeBig(MemoryHeap *heap, void *ptr);
 void CleanupBigAllocations(MemoryHeap *heap);
+int ReserveBig(MemoryHeap *heap, size_t size, size_t count);
+void TrimBigCache(MemoryHeap *heap);
 
 AllocBucket *CreateAllocBucket(MemoryHeap *heap, size_t size, size_t capacity);
 void DestroyAllocBucket(MemoryHeap *heap, AllocBucket *bucket);
@@ -86,11 +346,159 @@ void DestroyAllocBucket(MemoryHeap *heap, AllocBucket *bucket);
 void *BucketAlloc(MemoryHeap *heap, size_t size);
 void *BucketRealloc(MemoryHeap *heap, void *ptr, size_t new_size);
 void BucketFree(MemoryHeap *heap, void *ptr);
+// Same as BucketFree, without poisoning the memory
+void FreeBucketBlock(AllocBucket *bucket, void *ptr);
+// Gives ptr back to its bucket without the heap being locked,
+// returns 0 if ptr is not a bucket allocation
+int DeferBucketFree(void *ptr);
 
 void CleanupBucketAllocations(MemoryHeap *heap);
+int ReserveBuckets(MemoryHeap *heap, size_t size, size_t count);
+void TrimBuckets(MemoryHeap *heap);
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+// Adds the buckets of the heap to the page map of this process, or removes them
+void SetBucketPageMaps(MemoryHeap *heap, int attached);
+#endif
+// Returns the bucket the blocks of bucket should be moved to when compacting the heap,
+// or NULL if it is better left alone
+AllocBucket *GetCompactionTarget(MemoryHeap *heap, AllocBucket *bucket);
+void *AllocFromBucketForCompaction(AllocBucket *bucket, size_t size);
+void CleanupMovableHandles(MemoryHeap *heap);
+
+void *SpanAlloc(MemoryHeap *heap, size_t size);
+void *SpanRealloc(MemoryHeap *heap, void *ptr, size_t new_size);
+void SpanFree(MemoryHeap *heap, void *ptr);
+
+void CleanupSpanAllocations(MemoryHeap *heap);
+int ReserveSpans(MemoryHeap *heap, size_t size, size_t count);
+void TrimSpans(MemoryHeap *heap);
+
+void AddHeapLayout(MemoryHeap *heap, HeapLayout *layout);
+
+// Allocates up to count blocks of size from the current thread's heap
+// at once, returns how many could be allocated
+int AllocBatch(size_t size, void **ptrs, int count);
+// Frees a block of a thread cache, which was poisoned when it entered the cache
+void FreeThreadCacheBlock(void *ptr);
+void ResetThreadCache();
 
 size_t GetPageSize();
 
+void InitHeap(MemoryHeap *heap);
+
+void *AllocHeapFilePages(HeapFile *file, size_t size);
+void FreeHeapFilePages(HeapFile *file, void *ptr, size_t size);
+void DetachHeapFile(MemoryHeap *heap);
+
+// Resolved values of the options that can be set with FT_MALLOC_CONF,
+// only written once by LoadMallocConfig before the first heap is created
+typedef struct MallocConfig
+{
+    uint32_t min_bucket_capacity;
+    uint32_t max_bucket_capacity;
+    uint32_t thread_cache_capacity;
+    uint32_t print_stats;
+    size_t big_cache_capacity;
+    size_t big_cache_max_size;
+    size_t non_temporal_threshold;
+    uint32_t guarded_sample_rate;
+    uint32_t guarded_slots;
+    int poison_mode;
+    int loaded;
+} __attribute__((aligned(64))) MallocConfig;
+
+extern MallocConfig malloc_config;
+
+void LoadMallocConfig();
+
+// Bounds of the pool of guarded allocations, both 0 until the first allocation is sampled
+extern uintptr_t guarded_pool_start;
+extern size_t guarded_pool_size;
+
+static inline int IsGuardedAllocation(void *ptr)
+{
+    return (uintptr_t)ptr - guarded_pool_start < guarded_pool_size;
+}
+
+// Allocations left before the next sample of the calling thread, 0 before its first allocation
+extern __thread uint32_t guarded_sample_countdown __attribute__((tls_model("initial-exec")));
+
+void *SampleGuardedAllocSlow(size_t size);
+
+// Returns a guarded allocation on average once every guarded_sample_rate calls, NULL otherwise
+static inline void *SampleGuardedAlloc(size_t size)
+{
+    if (__builtin_expect(guarded_sample_countdown > 1, 1))
+    {
+        guarded_sample_countdown -= 1;
+        return NULL;
+    }
+
+    return SampleGuardedAllocSlow(size);
+}
+// Counts the blocks of a thread cache refill against the sampling countdown, and swaps
+// a guarded allocation into the batch when it expires. Must be called with the lock of heap held.
+void SampleGuardedBatch(MemoryHeap *heap, size_t size, void **ptrs, int count);
+size_t GetGuardedAllocationSize(void *ptr);
+void FreeGuarded(void *ptr);
+// Moves the memory to heap, or to the global heap if heap is NULL
+void *ReallocGuarded(MemoryHeap *heap, void *ptr, size_t new_size);
+void *HeapAllocUnsampled(MemoryHeap *heap, size_t size);
+void PrepareGuardedFork();
+void ResumeGuardedParentAfterFork();
+void ResumeGuardedChildAfterFork();
+
+// The non temporal threshold can not be lower than two blocks
+#define NON_TEMPORAL_BLOCK_SIZE 128
+
+// memcpy and memset that bypass the cache for sizes above the non temporal threshold
+void CopyMemory(void *dst, const void *src, size_t size);
+void FillMemory(void *dst, int value, size_t size);
+
+static inline void PoisonFreedMemory(MemoryHeap *heap, void *ptr, size_t size)
+{
+    if (__builtin_expect(heap->poison_mode == FT_MALLOC_POISON_BOUNDED, 0))
+    {
+        // A memset of constant size compiles to a few stores
+        if (size >= FT_MALLOC_POISON_BOUNDED_SIZE)
+            memset(ptr, FT_MALLOC_MEMORY_PATTERN_FREED, FT_MALLOC_POISON_BOUNDED_SIZE);
+        else
+            memset(ptr, FT_MALLOC_MEMORY_PATTERN_FREED, size);
+    }
+    else if (__builtin_expect(heap->poison_mode != FT_MALLOC_POISON_OFF, 0))
+    {
+        FillMemory(ptr, FT_MALLOC_MEMORY_PATTERN_FREED, size);
+    }
+}
+
+static inline void PoisonAllocatedMemory(MemoryHeap *heap, void *ptr, size_t size)
+{
+    if (__builtin_expect(heap->poison_mode == FT_MALLOC_POISON_FULL, 0))
+        FillMemory(ptr, FT_MALLOC_MEMORY_PATTERN_ALLOCATED_UNTOUCHED, size);
+}
+
+static inline int GetSizeClass(size_t size)
+{
+    FT_Assert(size <= FT_MALLOC_MAX_SMALL_SIZE);
+
+    if (size <= FT_MALLOC_MIN_SIZE)
+        return 0;
+
+    size -= FT_MALLOC_MIN_SIZE;
+
+    return (int)((size + FT_MALLOC_SMALL_SIZE_GRANULARITY - 1) / FT_MALLOC_SMALL_SIZE_GRANULARITY);
+}
+
+static inline size_t AlignSizeToSizeClass(size_t size)
+{
+    return FT_MALLOC_MIN_SIZE + GetSizeClass(size) * FT_MALLOC_SMALL_SIZE_GRANULARITY;
+}
+
+static inline SpanChunk *GetSpanChunk(void *span)
+{
+    return (SpanChunk *)((uint64_t)span & ~((uint64_t)FT_MALLOC_SPAN_CHUNK_SIZE - 1));
+}
+
 static inline uint64_t AlignNumber(uint64_t x, uint64_t align)
 {
     if ((x % align) != 0)
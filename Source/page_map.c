@@ -0,0 +1,64 @@
+#include "malloc_internal.h"
+
+#ifdef FT_MALLOC_OUT_OF_LINE_METADATA
+
+// Two level radix tree mapping every 4 KiB page of bucket data to its bucket.
+// Leaves are created on demand and never freed, the root lives in the BSS
+// so untouched parts of it do not use any memory.
+#define PAGE_MAP_PAGE_SHIFT 12
+#define PAGE_MAP_ADDRESS_BITS 48
+#define PAGE_MAP_LEAF_BITS 18
+#define PAGE_MAP_ROOT_BITS (PAGE_MAP_ADDRESS_BITS - PAGE_MAP_PAGE_SHIFT - PAGE_MAP_LEAF_BITS)
+
+#define PAGE_MAP_LEAF_SIZE ((1ul << PAGE_MAP_LEAF_BITS) * sizeof(AllocBucket *))
+
+static AllocBucket **page_map[1ul << PAGE_MAP_ROOT_BITS];
+
+static AllocBucket **GetPageMapLeaf(uint64_t page, int create)
+{
+    uint64_t root_index = page >> PAGE_MAP_LEAF_BITS;
+    FT_Assert(root_index < (1ul << PAGE_MAP_ROOT_BITS));
+
+    AllocBucket **leaf = __atomic_load_n(&page_map[root_index], __ATOMIC_ACQUIRE);
+    if (leaf || !create)
+        return leaf;
+
+    leaf = mmap(NULL, PAGE_MAP_LEAF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    FT_Assert(leaf != MAP_FAILED);
+
+    // Another thread may have created the leaf in the meantime
+    AllocBucket **expected = NULL;
+    if (!__atomic_compare_exchange_n(&page_map[root_index], &expected, leaf, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        munmap(leaf, PAGE_MAP_LEAF_SIZE);
+        leaf = expected;
+    }
+
+    return leaf;
+}
+
+void SetPageMapRange(void *start, size_t size, AllocBucket *bucket)
+{
+    uint64_t first_page = (uint64_t)start >> PAGE_MAP_PAGE_SHIFT;
+    uint64_t last_page = ((uint64_t)start + size - 1) >> PAGE_MAP_PAGE_SHIFT;
+
+    for (uint64_t page = first_page; page <= last_page; page += 1)
+    {
+        AllocBucket **leaf = GetPageMapLeaf(page, bucket != NULL);
+        if (leaf)
+            __atomic_store_n(&leaf[page & ((1ul << PAGE_MAP_LEAF_BITS) - 1)], bucket, __ATOMIC_RELEASE);
+    }
+}
+
+AllocBucket *LookupPageMap(void *ptr)
+{
+    uint64_t page = (uint64_t)ptr >> PAGE_MAP_PAGE_SHIFT;
+
+    AllocBucket **leaf = GetPageMapLeaf(page, 0);
+    if (!leaf)
+        return NULL;
+
+    return __atomic_load_n(&leaf[page & ((1ul << PAGE_MAP_LEAF_BITS) - 1)], __ATOMIC_ACQUIRE);
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef FT_MALLOC_PROBES_H
+#define FT_MALLOC_PROBES_H
+
+// Static tracepoints in the format of systemtap's sys/sdt.h, so they can be attached to
+// with perf, bpftrace or systemtap (see Tools/). Each probe is a single nop whose address
+// and argument locations are recorded in a .note.stapsdt ELF note. Arguments are passed
+// as 64 bit unsigned values. Probes compile to nothing without FT_MALLOC_USDT_PROBES.
+//
+// The sampled probes also have a semaphore in the .probes section, which tracers increment
+// while they are attached, so their bookkeeping is skipped when nothing listens.
+
+#if defined(FT_MALLOC_USDT_PROBES) && defined(__x86_64__)
+
+#define FT_ProbeNote(name, semaphore, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte " semaphore "\n" \
+    ".asciz \"ft_malloc\"\n" \
+    ".asciz \"" name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define FT_ProbeArg(x) "nor"((uint64_t)(x))
+
+#define FT_Probe0(name) \
+    __asm__ volatile (FT_ProbeNote(#name, "0", ""))
+#define FT_Probe1(name, x0) \
+    __asm__ volatile (FT_ProbeNote(#name, "0", "8@%[a0]") :: [a0] FT_ProbeArg(x0))
+#define FT_Probe2(name, x0, x1) \
+    __asm__ volatile (FT_ProbeNote(#name, "0", "8@%[a0] 8@%[a1]") :: [a0] FT_ProbeArg(x0), [a1] FT_ProbeArg(x1))
+#define FT_Probe3(name, x0, x1, x2) \
+    __asm__ volatile (FT_ProbeNote(#name, "0", "8@%[a0] 8@%[a1] 8@%[a2]") \
+        :: [a0] FT_ProbeArg(x0), [a1] FT_ProbeArg(x1), [a2] FT_ProbeArg(x2))
+#define FT_Probe4(name, x0, x1, x2, x3) \
+    __asm__ volatile (FT_ProbeNote(#name, "0", "8@%[a0] 8@%[a1] 8@%[a2] 8@%[a3]") \
+        :: [a0] FT_ProbeArg(x0), [a1] FT_ProbeArg(x1), [a2] FT_ProbeArg(x2), [a3] FT_ProbeArg(x3))
+
+#define FT_ProbeEnabled(name) __builtin_expect(ft_malloc_##name##_semaphore != 0, 0)
+#define FT_SemaphoreProbe2(name, x0, x1) \
+    __asm__ volatile (FT_ProbeNote(#name, "ft_malloc_" #name "_semaphore", "8@%[a0] 8@%[a1]") \
+        :: [a0] FT_ProbeArg(x0), [a1] FT_ProbeArg(x1))
+#define FT_SemaphoreProbe3(name, x0, x1, x2) \
+    __asm__ volatile (FT_ProbeNote(#name, "ft_malloc_" #name "_semaphore", "8@%[a0] 8@%[a1] 8@%[a2]") \
+        :: [a0] FT_ProbeArg(x0), [a1] FT_ProbeArg(x1), [a2] FT_ProbeArg(x2))
+
+#else
+
+#define FT_ProbeEnabled(name) 0
+#define FT_SemaphoreProbe2(name, x0, x1)
+#define FT_SemaphoreProbe3(name, x0, x1, x2)
+#define FT_Probe0(name)
+#define FT_Probe1(name, x0)
+#define FT_Probe2(name, x0, x1)
+#define FT_Probe3(name, x0, x1, x2)
+#define FT_Probe4(name, x0, x1, x2, x3)
+
+#endif
+
+// One in this many bucket allocations and frees fires alloc_sample or free_sample,
+// including the ones served by the thread caches
+#define FT_MALLOC_PROBE_SAMPLE_RATE 1024
+
+// Defined even without probes, InlineAlloc reads the first one
+extern volatile unsigned short ft_malloc_alloc_sample_semaphore;
+extern volatile unsigned short ft_malloc_free_sample_semaphore;
+
+#endif
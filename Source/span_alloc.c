@@ -0,0 +1,345 @@
+#include "malloc_internal.h"
+
+static inline size_t GetSpanPageIndex(SpanChunk *chunk, void *span)
+{
+    return ((uint64_t)span - (uint64_t)chunk) / FT_MALLOC_SPAN_PAGE_SIZE;
+}
+
+static inline AllocHeader *GetSpan(SpanChunk *chunk, size_t page_index)
+{
+    return (AllocHeader *)((void *)chunk + page_index * FT_MALLOC_SPAN_PAGE_SIZE);
+}
+
+static inline size_t GetSpanPageCount(size_t size)
+{
+    return (size + sizeof(AllocHeader) + FT_MALLOC_SPAN_PAGE_SIZE - 1) / FT_MALLOC_SPAN_PAGE_SIZE;
+}
+
+static inline int GetFreeSpanListIndex(size_t num_pages)
+{
+    if (num_pages >= FT_MALLOC_NUM_FREE_SPAN_LISTS)
+        return FT_MALLOC_NUM_FREE_SPAN_LISTS - 1;
+
+    return (int)num_pages - 1;
+}
+
+static void MarkSpan(SpanChunk *chunk, size_t index, size_t num_pages, int is_free)
+{
+    uint16_t value = (uint16_t)num_pages;
+    if (is_free)
+        value |= FT_MALLOC_SPAN_FREE_BIT;
+
+    chunk->page_runs[index] = value;
+    chunk->page_runs[index + num_pages - 1] = value;
+}
+
+static void PushFreeSpan(MemoryHeap *heap, SpanChunk *chunk, size_t index, size_t num_pages)
+{
+    MarkSpan(chunk, index, num_pages, 1);
+
+    AllocHeader *span = GetSpan(chunk, index);
+    *span = (AllocHeader){};
+    span->size = num_pages;
+
+    int list = GetFreeSpanListIndex(num_pages);
+    ListPushFront(&heap->free_spans[list], span);
+    heap->free_span_mask[list / 64] |= 1ull << (list % 64);
+
+    chunk->num_free_pages += num_pages;
+}
+
+static void PopFreeSpan(MemoryHeap *heap, SpanChunk *chunk, size_t index, size_t num_pages)
+{
+    AllocHeader *span = GetSpan(chunk, index);
+
+    int list = GetFreeSpanListIndex(num_pages);
+    ListPop(&heap->free_spans[list], span);
+    if (!heap->free_spans[list])
+        heap->free_span_mask[list / 64] &= ~(1ull << (list % 64));
+
+    chunk->num_free_pages -= num_pages;
+}
+
+// Returns the smallest free span that is at least num_pages long
+static AllocHeader *FindFreeSpan(MemoryHeap *heap, size_t num_pages)
+{
+    int list = GetFreeSpanListIndex(num_pages);
+    int word = list / 64;
+    uint64_t mask = heap->free_span_mask[word] & (~0ull << (list % 64));
+    while (!mask)
+    {
+        word += 1;
+        if (word == FT_MALLOC_NUM_FREE_SPAN_LISTS / 64)
+            return NULL;
+
+        mask = heap->free_span_mask[word];
+    }
+
+    list = word * 64 + __builtin_ctzll(mask);
+    if (list != FT_MALLOC_NUM_FREE_SPAN_LISTS - 1)
+        return heap->free_spans[list];
+
+    // Spans in the last list are not all the same size
+    AllocHeader *best = NULL;
+    for (AllocHeader *span = heap->free_spans[list]; span; span = span->next)
+    {
+        if (span->size >= num_pages && (!best || span->size < best->size))
+            best = span;
+    }
+
+    return best;
+}
+
+static SpanChunk *CreateSpanChunk(MemoryHeap *heap)
+{
+    FT_DebugLog(">> CreateSpanChunk()\n");
+
+    // Chunks are aligned to their size so we can find the chunk of a span from its address
+    SpanChunk *chunk = MapHeapMemoryAligned(heap, FT_MALLOC_SPAN_CHUNK_SIZE, FT_MALLOC_SPAN_CHUNK_SIZE);
+    if (!chunk)
+        return NULL;
+
+    chunk->heap = heap;
+    ListPushFront(&heap->span_chunks, chunk);
+
+    PushFreeSpan(heap, chunk, FT_MALLOC_SPAN_CHUNK_HEADER_PAGES, FT_MALLOC_SPAN_CHUNK_USABLE_PAGES);
+
+    return chunk;
+}
+
+static void DestroySpanChunk(MemoryHeap *heap, SpanChunk *chunk)
+{
+    FT_DebugLog(">> DestroySpanChunk(%p)\n", chunk);
+
+    ListPop(&heap->span_chunks, chunk);
+    UnmapHeapMemory(heap, chunk, FT_MALLOC_SPAN_CHUNK_SIZE);
+}
+
+static size_t GetNumFreeSpanPages(MemoryHeap *heap, SpanChunk *except)
+{
+    size_t num_pages = 0;
+    for (SpanChunk *chunk = heap->span_chunks; chunk; chunk = chunk->next)
+    {
+        if (chunk != except)
+            num_pages += chunk->num_free_pages;
+    }
+
+    return num_pages;
+}
+
+// Gives pages back to the chunk, merging them with the neighboring free spans
+static void ReleaseSpanPages(MemoryHeap *heap, SpanChunk *chunk, size_t index, size_t num_pages)
+{
+    size_t next = index + num_pages;
+    if (next < FT_MALLOC_SPAN_PAGES_PER_CHUNK && (chunk->page_runs[next] & FT_MALLOC_SPAN_FREE_BIT))
+    {
+        size_t next_pages = chunk->page_runs[next] & ~FT_MALLOC_SPAN_FREE_BIT;
+        PopFreeSpan(heap, chunk, next, next_pages);
+        num_pages += next_pages;
+    }
+
+    if (index > FT_MALLOC_SPAN_CHUNK_HEADER_PAGES && (chunk->page_runs[index - 1] & FT_MALLOC_SPAN_FREE_BIT))
+    {
+        size_t prev_pages = chunk->page_runs[index - 1] & ~FT_MALLOC_SPAN_FREE_BIT;
+        index -= prev_pages;
+        PopFreeSpan(heap, chunk, index, prev_pages);
+        num_pages += prev_pages;
+    }
+
+    // Keep the last chunk around so alternating alloc/free does not map and unmap every time,
+    // and keep the chunks needed for the pages reserved with HeapReserve
+    if (num_pages == FT_MALLOC_SPAN_CHUNK_USABLE_PAGES && (chunk->prev || chunk->next)
+        && GetNumFreeSpanPages(heap, chunk) >= heap->reserved_span_pages)
+    {
+        DestroySpanChunk(heap, chunk);
+        return;
+    }
+
+    PushFreeSpan(heap, chunk, index, num_pages);
+}
+
+void *SpanAlloc(MemoryHeap *heap, size_t size)
+{
+    FT_DebugLog(">> SpanAlloc(%lu)\n", size);
+
+    FT_Assert(size <= FT_MALLOC_MAX_MID_SIZE);
+
+    size_t num_pages = GetSpanPageCount(size);
+    AllocHeader *span = FindFreeSpan(heap, num_pages);
+    if (!span)
+    {
+        if (!CreateSpanChunk(heap))
+            return NULL;
+
+        span = FindFreeSpan(heap, num_pages);
+        FT_Assert(span != NULL);
+    }
+
+    SpanChunk *chunk = GetSpanChunk(span);
+    size_t index = GetSpanPageIndex(chunk, span);
+    size_t span_pages = span->size;
+
+    PopFreeSpan(heap, chunk, index, span_pages);
+    if (span_pages > num_pages)
+        PushFreeSpan(heap, chunk, index + num_pages, span_pages - num_pages);
+
+    MarkSpan(chunk, index, num_pages, 0);
+
+    *span = (AllocHeader){};
+    span->size = size;
+
+    chunk->num_allocations += 1;
+    chunk->requested_bytes += size;
+
+    void *ptr = (void *)(span + 1);
+    PoisonAllocatedMemory(heap, ptr, size);
+
+    return ptr;
+}
+
+void *SpanRealloc(MemoryHeap *heap, void *ptr, size_t new_size)
+{
+    FT_DebugLog(">> SpanRealloc(%p, %lu)\n", ptr, new_size);
+
+    AllocHeader *header = (AllocHeader *)ptr - 1;
+    SpanChunk *chunk = GetSpanChunk(header);
+    size_t index = GetSpanPageIndex(chunk, header);
+    size_t num_pages = chunk->page_runs[index];
+    FT_Assert((num_pages & FT_MALLOC_SPAN_FREE_BIT) == 0);
+
+    if (new_size >= FT_MALLOC_MIN_MID_SIZE && new_size <= FT_MALLOC_MAX_MID_SIZE)
+    {
+        size_t new_num_pages = GetSpanPageCount(new_size);
+
+        // Shrink in place and give the tail pages back
+        if (new_num_pages <= num_pages)
+        {
+            if (header->size > new_size)
+                PoisonFreedMemory(heap, ptr + new_size, header->size - new_size);
+
+            if (new_num_pages < num_pages)
+            {
+                MarkSpan(chunk, index, new_num_pages, 0);
+                ReleaseSpanPages(heap, chunk, index + new_num_pages, num_pages - new_num_pages);
+            }
+
+            chunk->requested_bytes += new_size;
+            chunk->requested_bytes -= header->size;
+            header->size = new_size;
+
+            return ptr;
+        }
+
+        // Grow in place if the following span is free and big enough
+        size_t next = index + num_pages;
+        if (next < FT_MALLOC_SPAN_PAGES_PER_CHUNK && (chunk->page_runs[next] & FT_MALLOC_SPAN_FREE_BIT))
+        {
+            size_t next_pages = chunk->page_runs[next] & ~FT_MALLOC_SPAN_FREE_BIT;
+            if (num_pages + next_pages >= new_num_pages)
+            {
+                PopFreeSpan(heap, chunk, next, next_pages);
+
+                size_t remaining_pages = num_pages + next_pages - new_num_pages;
+                if (remaining_pages > 0)
+                    PushFreeSpan(heap, chunk, index + new_num_pages, remaining_pages);
+
+                MarkSpan(chunk, index, new_num_pages, 0);
+
+                PoisonAllocatedMemory(heap, ptr + header->size, new_size - header->size);
+
+                chunk->requested_bytes += new_size;
+                chunk->requested_bytes -= header->size;
+                header->size = new_size;
+
+                return ptr;
+            }
+        }
+    }
+
+    void *new_ptr = HeapAlloc(heap, new_size);
+    if (!new_ptr)
+        return NULL;
+
+    size_t bytes_to_copy = header->size > new_size ? new_size : header->size;
+    FT_Probe3(realloc_copy, ptr, new_ptr, bytes_to_copy);
+    CopyMemory(new_ptr, ptr, bytes_to_copy);
+    SpanFree(heap, ptr);
+
+    return new_ptr;
+}
+
+void SpanFree(MemoryHeap *heap, void *ptr)
+{
+    FT_DebugLog(">> SpanFree(%p)\n", ptr);
+
+    AllocHeader *header = (AllocHeader *)ptr - 1;
+    SpanChunk *chunk = GetSpanChunk(header);
+    size_t index = GetSpanPageIndex(chunk, header);
+    size_t num_pages = chunk->page_runs[index];
+    FT_Assert((num_pages & FT_MALLOC_SPAN_FREE_BIT) == 0);
+
+    PoisonFreedMemory(heap, ptr, header->size);
+
+    chunk->num_allocations -= 1;
+    chunk->requested_bytes -= header->size;
+
+    ReleaseSpanPages(heap, chunk, index, num_pages);
+}
+
+void CleanupSpanAllocations(MemoryHeap *heap)
+{
+    FT_DebugLog(">> CleanupSpanAllocations\n");
+
+    while (heap->span_chunks)
+    {
+        DestroySpanChunk(heap, heap->span_chunks);
+    }
+
+    memset(heap->free_span_mask, 0, sizeof(heap->free_span_mask));
+    memset(heap->free_spans, 0, sizeof(heap->free_spans));
+    heap->reserved_span_pages = 0;
+}
+
+void TrimSpans(MemoryHeap *heap)
+{
+    SpanChunk *chunk = heap->span_chunks;
+    while (chunk)
+    {
+        SpanChunk *next = chunk->next;
+
+        if (chunk->num_free_pages == FT_MALLOC_SPAN_CHUNK_USABLE_PAGES
+            && GetNumFreeSpanPages(heap, chunk) >= heap->reserved_span_pages)
+        {
+            PopFreeSpan(heap, chunk, FT_MALLOC_SPAN_CHUNK_HEADER_PAGES, FT_MALLOC_SPAN_CHUNK_USABLE_PAGES);
+            DestroySpanChunk(heap, chunk);
+        }
+
+        chunk = next;
+    }
+}
+
+int ReserveSpans(MemoryHeap *heap, size_t size, size_t count)
+{
+    FT_DebugLog(">> ReserveSpans(%lu, %lu)\n", size, count);
+
+    size_t num_pages = GetSpanPageCount(size);
+    heap->reserved_span_pages = count * num_pages;
+
+    // Count the spans of num_pages that fit in the free spans we already have
+    size_t num_spans = 0;
+    for (int i = 0; i < FT_MALLOC_NUM_FREE_SPAN_LISTS; i += 1)
+    {
+        for (AllocHeader *span = heap->free_spans[i]; span; span = span->next)
+            num_spans += span->size / num_pages;
+    }
+
+    while (num_spans < count)
+    {
+        if (!CreateSpanChunk(heap))
+            return -1;
+
+        num_spans += FT_MALLOC_SPAN_CHUNK_USABLE_PAGES / num_pages;
+    }
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include "malloc_internal.h"
+#include "../ft_malloc_inline.h"
+
+#include <pthread.h>
+
+__thread ThreadCache thread_cache __attribute__((tls_model("initial-exec")));
+
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_cache_key;
+
+#ifdef FT_MALLOC_USDT_PROBES
+static __thread uint64_t thread_cache_probe_sample_counter;
+#endif
+
+static void FlushThreadCacheAtExit(void *data)
+{
+    (void)data;
+    FlushThreadCache();
+}
+
+static void CreateThreadCacheKey()
+{
+    pthread_key_create(&thread_cache_key, FlushThreadCacheAtExit);
+}
+
+// The key only has a value so its destructor gets called when the thread exits
+static void RegisterThreadCache()
+{
+    pthread_once(&thread_cache_key_once, CreateThreadCacheKey);
+    pthread_setspecific(thread_cache_key, &thread_cache);
+    thread_cache.registered = 1;
+}
+
+static void PushThreadCacheBlock(ThreadCacheBin *bin, void *ptr)
+{
+    *(void **)ptr = bin->free_list;
+    bin->free_list = ptr;
+    bin->count += 1;
+}
+
+static void *PopThreadCacheBlock(ThreadCacheBin *bin)
+{
+    void *ptr = bin->free_list;
+    bin->free_list = *(void **)ptr;
+    bin->count -= 1;
+
+    return ptr;
+}
+
+void ProbeThreadCacheAlloc(void *ptr, size_t size)
+{
+#ifdef FT_MALLOC_USDT_PROBES
+    thread_cache_probe_sample_counter += 1;
+    if (thread_cache_probe_sample_counter % FT_MALLOC_PROBE_SAMPLE_RATE == 0)
+        FT_SemaphoreProbe3(alloc_sample, ptr, size, AlignSizeToSizeClass(size));
+#else
+    (void)ptr;
+    (void)size;
+#endif
+}
+
+void *ThreadCacheAlloc(size_t size)
+{
+    if (size == 0 || size > FT_MALLOC_MAX_SMALL_SIZE)
+        return Alloc(size);
+
+    if (!thread_cache.registered)
+        RegisterThreadCache();
+
+    size_t size_class = GetSizeClass(size);
+    ThreadCacheBin *bin = &thread_cache.bins[size_class];
+
+    // Cached blocks span their whole size class, so Realloc can
+    // tell how much of them may have been written to
+    size_t alloc_size = AlignSizeToSizeClass(size);
+
+    void *ptrs[FT_MALLOC_THREAD_CACHE_REFILL_COUNT];
+    int count = AllocBatch(alloc_size, ptrs, FT_MALLOC_THREAD_CACHE_REFILL_COUNT);
+    if (count == 0)
+        return NULL;
+
+    for (int i = 1; i < count; i += 1)
+        PushThreadCacheBlock(bin, ptrs[i]);
+
+    return ptrs[0];
+}
+
+void ThreadCacheFree(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    if (IsGuardedAllocation(ptr))
+    {
+        FreeGuarded(ptr);
+        return;
+    }
+
+    // Only blocks that span their whole size class can be handed out again
+    // without updating the bucket, which may belong to another thread's arena
+    AllocBucket *bucket = GetAllocationBucket(ptr);
+    if (!bucket || GetBucketBlockHeader(bucket, ptr)->size != bucket->alloc_size)
+    {
+        Free(ptr);
+        return;
+    }
+
+    // Blocks handed out from the cache would not get the allocated pattern
+    if (bucket->heap->poison_mode == FT_MALLOC_POISON_FULL)
+    {
+        Free(ptr);
+        return;
+    }
+
+    if (!thread_cache.registered)
+        RegisterThreadCache();
+
+    // The block spans its whole size class, which is also its requested size.
+    // It is not poisoned again when it leaves the cache.
+    PoisonFreedMemory(bucket->heap, ptr, bucket->alloc_size);
+
+#ifdef FT_MALLOC_USDT_PROBES
+    if (FT_ProbeEnabled(free_sample))
+    {
+        thread_cache_probe_sample_counter += 1;
+        if (thread_cache_probe_sample_counter % FT_MALLOC_PROBE_SAMPLE_RATE == 0)
+            FT_SemaphoreProbe2(free_sample, ptr, bucket->alloc_size);
+    }
+#endif
+
+    ThreadCacheBin *bin = &thread_cache.bins[GetSizeClass(bucket->alloc_size)];
+    if ((uint32_t)bin->count >= malloc_config.thread_cache_capacity)
+    {
+        while ((uint32_t)bin->count > malloc_config.thread_cache_capacity / 2)
+            FreeThreadCacheBlock(PopThreadCacheBlock(bin));
+    }
+
+    PushThreadCacheBlock(bin, ptr);
+}
+
+void FlushThreadCache()
+{
+    for (int i = 0; i < FT_MALLOC_NUM_SMALL_SIZE_CLASS; i += 1)
+    {
+        ThreadCacheBin *bin = &thread_cache.bins[i];
+        while (bin->free_list)
+            FreeThreadCacheBlock(PopThreadCacheBlock(bin));
+    }
+}
+
+void ResetThreadCache()
+{
+    for (int i = 0; i < FT_MALLOC_NUM_SMALL_SIZE_CLASS; i += 1)
+        thread_cache.bins[i] = (ThreadCacheBin){};
+}
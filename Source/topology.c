@@ -0,0 +1,109 @@
+#include "malloc_internal.h"
+
+#ifdef FT_MALLOC_PER_CPU_ARENAS
+
+#include <sys/syscall.h>
+
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define FT_MALLOC_HAS_RSEQ
+#endif
+
+#ifdef FT_MALLOC_NUMA_AWARE
+
+#include <linux/mempolicy.h>
+
+// When simulating a topology, each thread is assigned a virtual CPU the
+// first time it asks for one, and virtual CPUs are spread across nodes
+static int simulated_num_cpus;
+static int simulated_num_nodes;
+static int next_simulated_cpu;
+static __thread int simulated_cpu = -1;
+
+void SimulateNumaTopology(int num_cpus, int num_nodes)
+{
+    FT_Assert(num_cpus > 0 && num_nodes > 0 && num_nodes <= FT_MALLOC_MAX_NUMA_NODES);
+
+    simulated_num_cpus = num_cpus;
+    simulated_num_nodes = num_nodes;
+}
+
+static int GetSimulatedCpu()
+{
+    if (simulated_cpu < 0)
+        simulated_cpu = __atomic_fetch_add(&next_simulated_cpu, 1, __ATOMIC_RELAXED) % simulated_num_cpus;
+
+    return simulated_cpu;
+}
+
+int GetCurrentNumaNode()
+{
+    if (simulated_num_nodes > 0)
+        return GetSimulatedCpu() % simulated_num_nodes;
+
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+    if (getcpu(&cpu, &node) != 0)
+        return 0;
+
+    return (int)node;
+}
+
+void BindMemoryToNumaNode(void *ptr, size_t size, int node)
+{
+    // Simulated nodes do not exist, there is nothing to bind to
+    if (simulated_num_nodes > 0 || node < 0)
+        return;
+
+    // We prefer the node instead of strictly binding to it,
+    // so we fall back to other nodes instead of failing when the node is full
+    unsigned long node_mask[FT_MALLOC_MAX_NUMA_NODES / 64] = {};
+    node_mask[node / 64] |= 1ul << (node % 64);
+
+    // The kernel reads one bit less than maxnode, so pass one more like libnuma does
+    syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, node_mask, FT_MALLOC_MAX_NUMA_NODES + 1, 0);
+}
+
+int GetAllocationNumaNode(void *ptr)
+{
+    // Simulated nodes only exist in the arenas
+    if (simulated_num_nodes > 0)
+        return IsGuardedAllocation(ptr) ? -1 : GetAllocationHeap(ptr)->numa_node;
+
+    // The node the page of ptr is on, which faults the page in if it was never touched
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, ptr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        return -1;
+
+    return node;
+}
+
+#endif
+
+int GetCurrentCpu()
+{
+#ifdef FT_MALLOC_NUMA_AWARE
+    if (simulated_num_cpus > 0)
+        return GetSimulatedCpu();
+#endif
+
+#ifdef FT_MALLOC_HAS_RSEQ
+    // glibc registers an rseq area for every thread that the kernel keeps
+    // up to date with the current CPU, reading it is a plain load
+    if (__rseq_size > 0)
+    {
+        struct rseq *rseq_area = (struct rseq *)((void *)__builtin_thread_pointer() + __rseq_offset);
+        int cpu = (int)__atomic_load_n(&rseq_area->cpu_id, __ATOMIC_RELAXED);
+        if (cpu >= 0)
+            return cpu;
+    }
+#endif
+
+    int cpu = sched_getcpu();
+    if (cpu < 0)
+        return 0;
+
+    return cpu;
+}
+
+#endif
@@ -43,8 +43,8 @@ int main()
     printf("           min=%d\n", FT_MALLOC_MIN_SMALL_SIZE);
     printf("           max=%d\n", FT_MALLOC_MAX_SMALL_SIZE);
 
-    printf("Mid size   granularity=%d\n", FT_MALLOC_MID_SIZE_GRANULARITY);
-    printf("           class count=%d\n", FT_MALLOC_NUM_MID_SIZE_CLASS);
+    printf("Mid size   span page size=%d\n", FT_MALLOC_SPAN_PAGE_SIZE);
+    printf("           span chunk size=%d\n", FT_MALLOC_SPAN_CHUNK_SIZE);
     printf("           min=%d\n", FT_MALLOC_MIN_MID_SIZE);
     printf("           max=%d\n", FT_MALLOC_MAX_MID_SIZE);
 
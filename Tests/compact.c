@@ -0,0 +1,162 @@
+#include "common.h"
+
+#define NUM_OBJECTS 20000
+#define OBJECT_SIZE 64
+#define SMALL_OBJECT_SIZE 32
+#define KEEP_EVERY 10
+
+static bool Expect(const char *name, bool value)
+{
+    if (!value)
+        printf("Error: expected %s\n", name);
+
+    return value;
+}
+
+static void *GetAddress(MovableHandle handle)
+{
+    void *ptr = PinMovable(handle);
+    UnpinMovable(handle);
+
+    return ptr;
+}
+
+static bool CheckObject(MovableHandle handle, int index, size_t size)
+{
+    int *ptr = PinMovable(handle);
+    bool ok = ptr[0] == index && ptr[size / sizeof(int) - 1] == index;
+    UnpinMovable(handle);
+
+    if (!ok)
+        printf("Error: object %d was not preserved\n", index);
+
+    return ok;
+}
+
+// Handles do not live in buckets, so objects of the smallest size class can be compacted too
+static bool TestSmallObjects()
+{
+    struct MemoryHeap *heap = CreateHeap();
+
+    static MovableHandle handles[NUM_OBJECTS];
+    for (int i = 0; i < NUM_OBJECTS; i += 1)
+    {
+        handles[i] = HeapAllocMovable(heap, SMALL_OBJECT_SIZE);
+        int *ptr = PinMovable(handles[i]);
+        for (size_t j = 0; j < SMALL_OBJECT_SIZE / sizeof(int); j += 1)
+            ptr[j] = i;
+        UnpinMovable(handles[i]);
+    }
+
+    for (int i = 0; i < NUM_OBJECTS; i += 1)
+    {
+        if (i % KEEP_EVERY != 0)
+            HeapFreeMovable(heap, handles[i]);
+    }
+
+    HeapLayout before;
+    GetHeapLayout(heap, &before);
+
+    size_t released = HeapCompact(heap, SIZE_MAX);
+
+    HeapLayout after;
+    GetHeapLayout(heap, &after);
+
+    printf("Compaction of small objects released %lu bytes, %lu buckets -> %lu buckets\n", released, before.num_buckets, after.num_buckets);
+
+    bool ok = true;
+    ok &= Expect("compaction of small objects to release buckets", released > 0 && after.num_buckets < before.num_buckets);
+    ok &= Expect("handles not to take bucket space", after.num_bucket_allocations == NUM_OBJECTS / KEEP_EVERY);
+
+    for (int i = 0; i < NUM_OBJECTS; i += KEEP_EVERY)
+        ok &= CheckObject(handles[i], i, SMALL_OBJECT_SIZE);
+
+    for (int i = 0; i < NUM_OBJECTS; i += KEEP_EVERY)
+        HeapFreeMovable(heap, handles[i]);
+
+    HeapLayout empty;
+    GetHeapLayout(heap, &empty);
+    ok &= Expect("a single handle block left after freeing every small object", empty.num_movable_handle_blocks == 1);
+
+    DestroyHeap(heap);
+
+    return ok;
+}
+
+int main()
+{
+    struct MemoryHeap *heap = CreateHeap();
+
+    static MovableHandle handles[NUM_OBJECTS];
+    for (int i = 0; i < NUM_OBJECTS; i += 1)
+    {
+        handles[i] = HeapAllocMovable(heap, OBJECT_SIZE);
+        int *ptr = PinMovable(handles[i]);
+        for (size_t j = 0; j < OBJECT_SIZE / sizeof(int); j += 1)
+            ptr[j] = i;
+        UnpinMovable(handles[i]);
+    }
+
+    // Leave the buckets sparsely occupied
+    for (int i = 0; i < NUM_OBJECTS; i += 1)
+    {
+        if (i % KEEP_EVERY != 0)
+        {
+            HeapFreeMovable(heap, handles[i]);
+            handles[i] = NULL;
+        }
+    }
+
+    HeapLayout before;
+    GetHeapLayout(heap, &before);
+
+    // Pinned objects stay where they are
+    void *pinned = PinMovable(handles[0]);
+
+    // A small budget only moves a few objects
+    void *ptrs[NUM_OBJECTS] = {};
+    for (int i = 0; i < NUM_OBJECTS; i += KEEP_EVERY)
+        ptrs[i] = GetAddress(handles[i]);
+
+    HeapCompact(heap, 4 * OBJECT_SIZE);
+
+    int num_moved = 0;
+    for (int i = 0; i < NUM_OBJECTS; i += KEEP_EVERY)
+        num_moved += ptrs[i] != GetAddress(handles[i]);
+
+    bool ok = true;
+    ok &= Expect("the budget to limit the number of moved objects", num_moved <= 4);
+
+    size_t released = HeapCompact(heap, SIZE_MAX);
+
+    HeapLayout after;
+    GetHeapLayout(heap, &after);
+
+    printf("Compaction released %lu bytes, %lu buckets -> %lu buckets\n", released, before.num_buckets, after.num_buckets);
+
+    ok &= Expect("compaction to release memory", released > 0 && after.mapped_bytes < before.mapped_bytes);
+    ok &= Expect("compaction to release buckets", after.num_buckets < before.num_buckets);
+    ok &= Expect("the pinned object not to move", PinMovable(handles[0]) == pinned);
+    UnpinMovable(handles[0]);
+    UnpinMovable(handles[0]);
+
+    // Once unpinned, the last object keeping a sparse bucket alive can be moved too
+    HeapCompact(heap, SIZE_MAX);
+    ok &= Expect("a compaction of a compact heap to release nothing", HeapCompact(heap, SIZE_MAX) == 0);
+
+    for (int i = 0; i < NUM_OBJECTS; i += KEEP_EVERY)
+        ok &= CheckObject(handles[i], i, OBJECT_SIZE);
+
+    for (int i = 0; i < NUM_OBJECTS; i += KEEP_EVERY)
+        HeapFreeMovable(heap, handles[i]);
+
+    HeapLayout empty;
+    GetHeapLayout(heap, &empty);
+    ok &= Expect("no allocations after freeing everything", empty.num_allocations == 0);
+
+    DestroyHeap(heap);
+
+    ok &= TestSmallObjects();
+
+    return ok ? 0 : 1;
+}
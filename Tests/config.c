@@ -0,0 +1,77 @@
+#include "common.h"
+
+#define CONF "min_bucket_capacity:1k,max_bucket_capacity:1k,big_cache_capacity:2,big_cache_max_size:1m,,unknown:1,stats:2,thread_cache_capacity:x,non_temporal_threshold:0,poison:free"
+#define NUM_SMALL 3000
+
+static bool Expect(const char *name, size_t value, size_t expected)
+{
+    if (value == expected)
+        return true;
+
+    printf("Error: expected %s to be %lu, got %lu\n", name, expected, value);
+
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    // The configuration is read once, before the first heap is created,
+    // so run the test again with FT_MALLOC_CONF set
+    if (!getenv("FT_MALLOC_CONF"))
+    {
+        char *env[] = {"FT_MALLOC_CONF=" CONF, NULL};
+        execve("/proc/self/exe", argv, env);
+        perror("execve");
+
+        return 1;
+    }
+
+    printf("FT_MALLOC_CONF=%s\n", getenv("FT_MALLOC_CONF"));
+
+    struct MemoryHeap *heap = CreateHeap();
+
+    static void *ptrs[NUM_SMALL];
+    for (int i = 0; i < NUM_SMALL; i += 1)
+        ptrs[i] = HeapAlloc(heap, 40);
+
+    HeapLayout layout;
+    GetHeapLayout(heap, &layout);
+
+    // Every bucket gets the same capacity, rounded up to whole pages
+    SizeClassLayout *size_class = &layout.size_classes[1];
+    bool ok = true;
+    ok &= Expect("allocations of the size class", size_class->num_allocations, NUM_SMALL);
+    ok &= Expect("buckets of the size class", size_class->num_buckets, 3);
+    ok &= Expect("buckets with a capacity of about 1k", size_class->capacity / size_class->num_buckets / 1024, 1);
+
+    for (int i = 0; i < NUM_SMALL; i += 1)
+        HeapFree(heap, ptrs[i]);
+
+    // Big allocations up to 1m stay mapped when freed, without any HeapReserve
+    void *small_big = HeapAlloc(heap, 100000);
+    void *large_big = HeapAlloc(heap, 2 * 1024 * 1024);
+    HeapFree(heap, small_big);
+    HeapFree(heap, large_big);
+
+    GetHeapLayout(heap, &layout);
+    ok &= Expect("cached big allocations", layout.num_big_cached, 1);
+
+    // Trimming gives them back, since they are not reserved
+    HeapTrim(heap);
+    GetHeapLayout(heap, &layout);
+    ok &= Expect("cached big allocations after trimming", layout.num_big_cached, 0);
+    ok &= Expect("cached big bytes after trimming", layout.big_cached_bytes, 0);
+
+    // A threshold of 0 is rejected, small copies and fills never take the non temporal path
+    void *ptr = HeapAlloc(heap, 60);
+    memset(ptr, 1, 60);
+    ptr = HeapRealloc(heap, ptr, 50);
+    ptr = HeapRealloc(heap, ptr, 5000);
+    HeapFree(heap, ptr);
+
+    DestroyHeap(heap);
+
+    return ok ? 0 : 1;
+}
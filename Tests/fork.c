@@ -0,0 +1,123 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define NUM_THREADS 4
+#define NUM_FORKS 100
+#define CHILD_TIMEOUT_SECONDS 10
+
+static volatile bool stop_threads;
+
+// rand takes a lock in glibc, which a thread could be holding when we fork
+static size_t GetAllocSize(unsigned int *seed)
+{
+    static const size_t Sizes[] = {
+        16, 32, 100, 1000, 1601, 5000, 20000, 70000, 300000
+    };
+    static const int Num_Sizes = sizeof(Sizes) / sizeof(*Sizes);
+
+    return Sizes[rand_r(seed) % Num_Sizes];
+}
+
+static void *ThreadMain(void *data)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)data;
+
+    void *ptrs[64] = {};
+    unsigned int i = 0;
+    while (!stop_threads)
+    {
+        unsigned int index = i % 64;
+        Free(ptrs[index]);
+        ptrs[index] = Alloc(GetAllocSize(&seed));
+        i += 1;
+    }
+
+    for (int j = 0; j < 64; j += 1)
+        Free(ptrs[j]);
+
+    return NULL;
+}
+
+// The child must be able to use the allocator right away,
+// a lock inherited in the locked state would hang it
+static void ChildMain()
+{
+    alarm(CHILD_TIMEOUT_SECONDS);
+
+    unsigned int seed = (unsigned int)getpid();
+    void *ptrs[100];
+    for (int i = 0; i < 100; i += 1)
+    {
+        size_t size = GetAllocSize(&seed);
+        ptrs[i] = Alloc(size);
+        memset(ptrs[i], i, size);
+    }
+
+    for (int i = 0; i < 100; i += 1)
+        Free(ptrs[i]);
+
+    _exit(0);
+}
+
+// Sampled allocations take a lock of their own, which must be handled across fork too
+#define GUARDED_CONF "guarded_sample_rate:2,guarded_slots:4096"
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    int num_threads = 0;
+#ifdef FT_MALLOC_PER_CPU_ARENAS
+    num_threads = NUM_THREADS;
+#endif
+
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < num_threads; i += 1)
+        pthread_create(&threads[i], NULL, ThreadMain, (void *)(uintptr_t)(i + 1));
+
+    for (int i = 0; i < NUM_FORKS; i += 1)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            printf("Error: fork failed (%s)\n", strerror(errno));
+            return 1;
+        }
+
+        if (pid == 0)
+            ChildMain();
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            printf("Error: child %d did not exit cleanly (status %d)\n", i, status);
+            return 1;
+        }
+    }
+
+    stop_threads = true;
+    for (int i = 0; i < num_threads; i += 1)
+        pthread_join(threads[i], NULL);
+
+    printf("Forked %d times with %d allocating threads\n", NUM_FORKS, num_threads);
+
+    DestroyGlobalHeap();
+
+    // The configuration is read once, so run the test again with sampling enabled
+    if (!getenv("FT_MALLOC_CONF"))
+    {
+        char *env[] = {"FT_MALLOC_CONF=" GUARDED_CONF, NULL};
+        fflush(stdout);
+        execve("/proc/self/exe", argv, env);
+        perror("execve");
+
+        return 1;
+    }
+
+    printf("FT_MALLOC_CONF=%s\n", getenv("FT_MALLOC_CONF"));
+
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include "common.h"
+#include "../ft_malloc_inline.h"
+
+#include <sys/wait.h>
+
+#define CONF "guarded_sample_rate:1,guarded_slots:16"
+#define NUM_ALLOCATIONS 1000
+#define NUM_PAIRS 20000
+#define NUM_RUNS 9
+#define OVERHEAD_SAMPLE_RATE 100000
+
+typedef enum Bug
+{
+    Bug_Overflow,
+    Bug_UseAfterFree,
+    Bug_InlineOverflow,
+} Bug;
+
+static void TriggerBug(Bug bug)
+{
+    volatile char *ptr;
+    switch (bug)
+    {
+    case Bug_Overflow:
+        ptr = Alloc(100);
+        ptr[(100 + FT_MALLOC_ALIGNMENT - 1) & ~(FT_MALLOC_ALIGNMENT - 1)] = 1;
+        break;
+    case Bug_UseAfterFree:
+        ptr = Alloc(100);
+        Free((void *)ptr);
+        ptr[0] = 1;
+        break;
+    case Bug_InlineOverflow:
+        // Thread cache refills span the whole size class
+        ptr = InlineAlloc(100);
+        ptr[(100 + FT_MALLOC_SMALL_SIZE_GRANULARITY - 1) & ~(FT_MALLOC_SMALL_SIZE_GRANULARITY - 1)] = 1;
+        break;
+    }
+}
+
+// Runs the bug in a child process, which must crash with a report containing expected
+static bool ExpectCrash(Bug bug, const char *expected)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(fds[1], 2);
+        TriggerBug(bug);
+        exit(0);
+    }
+
+    close(fds[1]);
+
+    static char report[16384];
+    size_t length = 0;
+    ssize_t n;
+    while ((n = read(fds[0], report + length, sizeof(report) - 1 - length)) > 0)
+        length += n;
+    report[length] = 0;
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV)
+    {
+        printf("Error: expected the %s to crash the process\n", expected);
+        return false;
+    }
+
+    if (!strstr(report, expected) || !strstr(report, "Allocated by:"))
+    {
+        printf("Error: expected a report of the %s, got:\n%s\n", expected, report);
+        return false;
+    }
+
+    printf("%s", report);
+
+    return true;
+}
+
+// Best time of an Alloc/Free pair, in nanoseconds
+static double MeasureAllocFree()
+{
+    double best = 0;
+    for (int run = 0; run < NUM_RUNS; run += 1)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+        for (int i = 0; i < NUM_PAIRS; i += 1)
+        {
+            volatile char *ptr = Alloc(100);
+            ptr[0] = 1;
+            Free((void *)ptr);
+        }
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+        double time = ElapsedTimeMS(start, end) * 1000000 / NUM_PAIRS;
+        if (run == 0 || time < best)
+            best = time;
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    // The configuration is read once, before the first heap is created, so pairs
+    // are measured without sampling here, then with every pair sampled in the new process.
+    // Timing a sampled rate directly is not reliable, samples are too rare compared to the noise.
+    if (!getenv("FT_MALLOC_CONF"))
+    {
+        char unsampled[32];
+        snprintf(unsampled, sizeof(unsampled), "%f", MeasureAllocFree());
+
+        char *args[] = {argv[0], unsampled, NULL};
+        char *env[] = {"FT_MALLOC_CONF=" CONF, NULL};
+        fflush(stdout);
+        execve("/proc/self/exe", args, env);
+        perror("execve");
+
+        return 1;
+    }
+
+    if (argc > 1)
+    {
+        double unsampled = atof(argv[1]);
+        double sampled = MeasureAllocFree();
+        printf("Alloc/Free pair %.1f ns, sampled %.1f us, CPU overhead of sampling one in %d: %.2f%%\n",
+            unsampled, sampled / 1000, OVERHEAD_SAMPLE_RATE, (sampled - unsampled) / (unsampled * OVERHEAD_SAMPLE_RATE) * 100);
+    }
+
+    bool ok = true;
+    ok &= ExpectCrash(Bug_Overflow, "buffer overflow");
+    ok &= ExpectCrash(Bug_UseAfterFree, "use after free");
+    ok &= ExpectCrash(Bug_InlineOverflow, "buffer overflow");
+
+    // Once every slot is in use, allocations fall back to the heap, and every path
+    // that frees or moves memory accepts guarded allocations
+    static void *ptrs[NUM_ALLOCATIONS];
+    for (int i = 0; i < NUM_ALLOCATIONS; i += 1)
+    {
+        size_t size = 1 + i * 7 % 5000;
+        ptrs[i] = Alloc(size);
+        memset(ptrs[i], i, size);
+    }
+
+    for (int i = 0; i < NUM_ALLOCATIONS; i += 1)
+    {
+        size_t size = 1 + i * 7 % 5000;
+        size_t new_size = size * 2;
+        ptrs[i] = Realloc(ptrs[i], new_size);
+        if (((unsigned char *)ptrs[i])[size - 1] != (unsigned char)i)
+        {
+            printf("Error: allocation %d was not preserved by Realloc\n", i);
+            ok = false;
+        }
+    }
+
+    for (int i = 0; i < NUM_ALLOCATIONS; i += 1)
+    {
+        if (i % 2 == 0)
+            Free(ptrs[i]);
+        else
+            InlineFree(ptrs[i]);
+    }
+
+    FlushThreadCache();
+
+    AllocationStats stats = GetAllocationStats();
+    if (stats.num_allocations != 0)
+    {
+        printf("Error: expected no allocations, got %lu\n", stats.num_allocations);
+        ok = false;
+    }
+
+    DestroyGlobalHeap();
+
+    return ok ? 0 : 1;
+}
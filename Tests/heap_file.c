@@ -0,0 +1,182 @@
+#include "common.h"
+
+#include <sys/wait.h>
+
+#define HEAP_FILE_SIZE (128 * 1024 * 1024)
+#define NUM_NODES 600
+
+typedef struct Node
+{
+    struct Node *next;
+    size_t size;
+    int value;
+} Node;
+
+static const size_t Sizes[] = {sizeof(Node), 100, 1000, 5000, 30000, 200000};
+static const int Num_Sizes = sizeof(Sizes) / sizeof(*Sizes);
+
+static Node *PushNode(struct MemoryHeap *heap, Node *list, int value)
+{
+    size_t size = Sizes[value % Num_Sizes];
+    Node *node = HeapAlloc(heap, size);
+    memset(node, value, size);
+    node->next = list;
+    node->size = size;
+    node->value = value;
+
+    return node;
+}
+
+// Nodes are pushed in order, so the list counts down from the first value
+static bool CheckList(Node *list, int first, int count)
+{
+    int value = first;
+    int num_nodes = 0;
+    for (Node *node = list; node; node = node->next)
+    {
+        unsigned char *bytes = (unsigned char *)node;
+        if (node->value != value || bytes[node->size - 1] != (unsigned char)value)
+        {
+            printf("Error: node %d was not preserved\n", value);
+            return false;
+        }
+
+        value -= 1;
+        num_nodes += 1;
+    }
+
+    if (num_nodes != count)
+    {
+        printf("Error: expected %d nodes, got %d\n", count, num_nodes);
+        return false;
+    }
+
+    return true;
+}
+
+static struct MemoryHeap *Attach(const char *path)
+{
+    struct MemoryHeap *heap = CreateHeapFromFile(path, HEAP_FILE_SIZE);
+    if (!heap)
+        printf("Error: could not attach %s (%s)\n", path, strerror(errno));
+
+    return heap;
+}
+
+// Simulates a restart of the program by attaching the heap in a new process
+static int RunChild(const char *path)
+{
+    struct MemoryHeap *heap = Attach(path);
+    if (!heap)
+        return 1;
+
+    Node *list = GetHeapRoot(heap);
+    if (!CheckList(list, NUM_NODES - 1, NUM_NODES))
+        return 1;
+
+    // Free the newest half of the nodes and replace them with new ones
+    for (int i = 0; i < NUM_NODES / 2; i += 1)
+    {
+        Node *next = list->next;
+        HeapFree(heap, list);
+        list = next;
+    }
+
+    for (int i = NUM_NODES / 2; i < NUM_NODES * 2; i += 1)
+        list = PushNode(heap, list, i);
+
+    SetHeapRoot(heap, list);
+    DestroyHeap(heap);
+
+    return 0;
+}
+
+int main()
+{
+    char path[] = "/tmp/ft_malloc_heap_file_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+
+    struct MemoryHeap *heap = Attach(path);
+    if (!heap)
+        return 1;
+
+    Node *list = NULL;
+    for (int i = 0; i < NUM_NODES; i += 1)
+        list = PushNode(heap, list, i);
+
+    SetHeapRoot(heap, list);
+
+    HeapLayout before;
+    GetHeapLayout(heap, &before);
+    DestroyHeap(heap);
+
+    bool ok = true;
+
+    pid_t pid = fork();
+    if (pid == 0)
+        exit(RunChild(path));
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("Error: the child process failed\n");
+        ok = false;
+    }
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    heap = Attach(path);
+    if (!heap)
+        return 1;
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    printf("Attached the heap file in %.3f ms\n", ElapsedTimeMS(start_time, end_time));
+
+    ok &= CheckList(GetHeapRoot(heap), NUM_NODES * 2 - 1, NUM_NODES * 2);
+
+    // The file can only be attached once at a time
+    if (CreateHeapFromFile(path, HEAP_FILE_SIZE) != NULL || errno != EBUSY)
+    {
+        printf("Error: expected attaching the heap twice to fail with EBUSY\n");
+        ok = false;
+    }
+
+    // Everything that is freed goes back to the file
+    list = GetHeapRoot(heap);
+    while (list)
+    {
+        Node *next = list->next;
+        HeapFree(heap, list);
+        list = next;
+    }
+
+    SetHeapRoot(heap, NULL);
+    HeapTrim(heap);
+
+    HeapLayout layout;
+    GetHeapLayout(heap, &layout);
+    printf("Heap file: %lu bytes mapped with %d nodes, %lu bytes mapped once empty\n", before.mapped_bytes, NUM_NODES, layout.mapped_bytes);
+    if (layout.num_allocations != 0 || layout.mapped_bytes >= before.mapped_bytes)
+    {
+        printf("Error: expected the memory of the heap to be released\n");
+        ok = false;
+    }
+
+    // Memory given back to the file can be allocated again
+    void *ptr = HeapAlloc(heap, 20 * 1024 * 1024);
+    if (!ptr)
+    {
+        printf("Error: could not allocate from the released memory\n");
+        ok = false;
+    }
+    HeapFree(heap, ptr);
+
+    DestroyHeap(heap);
+    unlink(path);
+
+    return ok ? 0 : 1;
+}
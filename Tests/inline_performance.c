@@ -0,0 +1,85 @@
+#include "common.h"
+#include "../ft_malloc_inline.h"
+
+#define NUM_SLOTS 64
+#define NUM_ITERATIONS 1000000
+
+static const size_t Sizes[] = {16, 32, 48, 100, 256, 1000, 1600};
+static const int Num_Sizes = sizeof(Sizes) / sizeof(*Sizes);
+
+static void *CallAlloc(size_t size) { return Alloc(size); }
+static void CallFree(void *ptr) { Free(ptr); }
+
+// Every slot is filled with its index, so a block handed out twice gets noticed
+static bool Run(const char *name, bool use_inline)
+{
+    void *ptrs[NUM_SLOTS] = {};
+    size_t sizes[NUM_SLOTS] = {};
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < NUM_ITERATIONS; i += 1)
+    {
+        int slot = i % NUM_SLOTS;
+        if (ptrs[slot])
+        {
+            if (*(unsigned char *)ptrs[slot] != (unsigned char)slot)
+            {
+                printf("Error: %s: block of slot %d was overwritten\n", name, slot);
+                return false;
+            }
+
+            if (use_inline)
+                InlineFree(ptrs[slot]);
+            else
+                CallFree(ptrs[slot]);
+        }
+
+        sizes[slot] = Sizes[(i / NUM_SLOTS + slot) % Num_Sizes];
+        ptrs[slot] = use_inline ? InlineAlloc(sizes[slot]) : CallAlloc(sizes[slot]);
+        memset(ptrs[slot], slot, sizes[slot]);
+    }
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    for (int i = 0; i < NUM_SLOTS; i += 1)
+    {
+        if (use_inline)
+            InlineFree(ptrs[i]);
+        else
+            Free(ptrs[i]);
+    }
+
+    double ns_per_op = ElapsedTimeMS(start_time, end_time) * 1000000.0 / (NUM_ITERATIONS * 2.0);
+    printf("%-22s %.1f ns per operation\n", name, ns_per_op);
+
+    return true;
+}
+
+int main()
+{
+    bool ok = true;
+    ok &= Run("Alloc/Free", false);
+    ok &= Run("InlineAlloc/InlineFree", true);
+
+    // Blocks of the inline fast path can be reallocated and freed normally
+    void *ptr = InlineAlloc(40);
+    memset(ptr, 1, 40);
+    ptr = Realloc(ptr, 1000);
+    Free(ptr);
+
+    FlushThreadCache();
+
+    AllocationStats stats = GetAllocationStats();
+    if (stats.num_allocations != 0)
+    {
+        printf("Error: expected no allocations after flushing the thread cache, got %lu\n", stats.num_allocations);
+        ok = false;
+    }
+
+    DestroyGlobalHeap();
+
+    return ok ? 0 : 1;
+}
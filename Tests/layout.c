@@ -0,0 +1,77 @@
+#include "common.h"
+
+#define NUM_SMALL 1000
+#define NUM_MID 100
+#define NUM_BIG 10
+
+static bool Expect(const char *name, size_t value, size_t expected)
+{
+    if (value == expected)
+        return true;
+
+    printf("Error: expected %s to be %lu, got %lu\n", name, expected, value);
+
+    return false;
+}
+
+int main()
+{
+    struct MemoryHeap *heap = CreateHeap();
+
+    void *small[NUM_SMALL];
+    void *mid[NUM_MID];
+    void *big[NUM_BIG];
+
+    for (int i = 0; i < NUM_SMALL; i += 1)
+        small[i] = HeapAlloc(heap, 40);
+    for (int i = 0; i < NUM_MID; i += 1)
+        mid[i] = HeapAlloc(heap, 2000);
+    for (int i = 0; i < NUM_BIG; i += 1)
+        big[i] = HeapAlloc(heap, 100000);
+
+    HeapLayout layout;
+    GetHeapLayout(heap, &layout);
+    PrintHeapLayout(&layout);
+
+    // 40 bytes allocations go in the 64 bytes size class
+    const SizeClassLayout *size_class = &layout.size_classes[1];
+    bool ok = true;
+    ok &= Expect("size class size", size_class->alloc_size, 64);
+    ok &= Expect("size class allocations", size_class->num_allocations, NUM_SMALL);
+    ok &= Expect("size class requested bytes", size_class->requested_bytes, NUM_SMALL * 40);
+    ok &= Expect("size class wasted bytes", size_class->wasted_bytes, NUM_SMALL * (64 - 40));
+    ok &= Expect("span allocations", layout.num_span_allocations, NUM_MID);
+    ok &= Expect("span requested bytes", layout.span_requested_bytes, NUM_MID * 2000);
+    ok &= Expect("big allocations", layout.num_big_allocations, NUM_BIG);
+    ok &= Expect("big requested bytes", layout.big_requested_bytes, NUM_BIG * 100000);
+    ok &= Expect("allocations", layout.num_allocations, NUM_SMALL + NUM_MID + NUM_BIG);
+
+    // Reallocating in place must keep the requested sizes up to date
+    small[0] = HeapRealloc(heap, small[0], 50);
+    mid[0] = HeapRealloc(heap, mid[0], 1700);
+    big[0] = HeapRealloc(heap, big[0], 90000);
+
+    GetHeapLayout(heap, &layout);
+    ok &= Expect("size class requested bytes after realloc", layout.size_classes[1].requested_bytes, NUM_SMALL * 40 + 10);
+    ok &= Expect("span requested bytes after realloc", layout.span_requested_bytes, NUM_MID * 2000 - 300);
+    ok &= Expect("big requested bytes after realloc", layout.big_requested_bytes, NUM_BIG * 100000 - 10000);
+
+    for (int i = 0; i < NUM_SMALL; i += 1)
+        HeapFree(heap, small[i]);
+    for (int i = 0; i < NUM_MID; i += 1)
+        HeapFree(heap, mid[i]);
+    for (int i = 0; i < NUM_BIG; i += 1)
+        HeapFree(heap, big[i]);
+
+    GetHeapLayout(heap, &layout);
+    ok &= Expect("allocations after free", layout.num_allocations, 0);
+    ok &= Expect("requested bytes after free", layout.requested_bytes, 0);
+    ok &= Expect("empty buckets after free", layout.num_empty_buckets, layout.num_buckets);
+    // Only one empty bucket is kept per size class
+    ok &= Expect("size class buckets after free", layout.size_classes[1].num_buckets, 1);
+    ok &= Expect("big mapped bytes after free", layout.big_mapped_bytes, 0);
+
+    DestroyHeap(heap);
+
+    return ok ? 0 : 1;
+}
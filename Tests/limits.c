@@ -0,0 +1,158 @@
+#include "common.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define SOFT_LIMIT (2 * 1024 * 1024)
+#define HARD_LIMIT (4 * 1024 * 1024)
+#define MAX_ALLOCS 1000
+
+static int num_pressure_calls;
+
+static void OnPressure(struct MemoryHeap *heap, size_t mapped_bytes, void *data)
+{
+    (void)heap;
+    (void)data;
+
+    if (num_pressure_calls == 0)
+        printf("Pressure callback called with %lu bytes mapped\n", mapped_bytes);
+
+    num_pressure_calls += 1;
+}
+
+static size_t GetMappedBytes(struct MemoryHeap *heap)
+{
+    HeapLayout layout;
+    GetHeapLayout(heap, &layout);
+
+    return layout.bucket_mapped_bytes + layout.span_mapped_bytes + layout.big_mapped_bytes + layout.big_cached_bytes;
+}
+
+// Span chunks are aligned by mapping more than they need, only the chunk counts towards the limit
+static bool TestSpanChunkLimit()
+{
+    struct MemoryHeap *heap = CreateHeap();
+    SetHeapLimits(heap, 0, FT_MALLOC_SPAN_CHUNK_SIZE);
+
+    void *ptr = HeapAlloc(heap, 5000);
+
+    HeapLayout layout;
+    GetHeapLayout(heap, &layout);
+
+    bool ok = true;
+    if (!ptr || layout.span_mapped_bytes != FT_MALLOC_SPAN_CHUNK_SIZE)
+    {
+        printf("Error: expected a span chunk to fit under a hard limit of its size (%lu bytes mapped)\n", layout.span_mapped_bytes);
+        ok = false;
+    }
+
+    HeapFree(heap, ptr);
+    DestroyHeap(heap);
+
+    return ok;
+}
+
+// Once the address space is full, not even the global heap can be created
+static bool TestGlobalHeapCreationFailure()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        long vm_pages = 0;
+        FILE *statm = fopen("/proc/self/statm", "r");
+        if (!statm || fscanf(statm, "%ld", &vm_pages) != 1)
+            _exit(2);
+        fclose(statm);
+
+        struct rlimit limit = {vm_pages * getpagesize(), vm_pages * getpagesize()};
+        setrlimit(RLIMIT_AS, &limit);
+
+        errno = 0;
+        void *ptr = Alloc(40);
+        int error = errno;
+        Free(ptr);
+        _exit(ptr == NULL && error == ENOMEM ? 0 : 1);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("Error: expected Alloc to fail with ENOMEM when the global heap can not be created (status %d)\n", status);
+        return false;
+    }
+
+    return true;
+}
+
+int main()
+{
+    struct MemoryHeap *heap = CreateHeap();
+    SetHeapLimits(heap, SOFT_LIMIT, HARD_LIMIT);
+    SetHeapPressureCallback(heap, OnPressure, NULL);
+
+    static const size_t Sizes[] = {100, 1000, 5000, 100000};
+    static const int Num_Sizes = sizeof(Sizes) / sizeof(*Sizes);
+
+    void *ptrs[MAX_ALLOCS];
+    int num_allocs = 0;
+    while (num_allocs < MAX_ALLOCS)
+    {
+        errno = 0;
+        void *ptr = HeapAlloc(heap, Sizes[num_allocs % Num_Sizes]);
+        if (!ptr)
+            break;
+
+        ptrs[num_allocs] = ptr;
+        num_allocs += 1;
+    }
+
+    bool ok = true;
+    if (num_allocs == MAX_ALLOCS || errno != ENOMEM)
+    {
+        printf("Error: expected an allocation to fail with ENOMEM, made %d allocations (errno %d)\n", num_allocs, errno);
+        ok = false;
+    }
+
+    if (num_pressure_calls == 0)
+    {
+        printf("Error: the pressure callback was never called\n");
+        ok = false;
+    }
+
+    if (GetMappedBytes(heap) > HARD_LIMIT)
+    {
+        printf("Error: %lu bytes are mapped, the hard limit is %d\n", GetMappedBytes(heap), HARD_LIMIT);
+        ok = false;
+    }
+
+    printf("Made %d allocations before reaching the hard limit\n", num_allocs);
+
+    // Freeing leaves some memory mapped for reuse, trimming gives it back
+    for (int i = 0; i < num_allocs; i += 1)
+        HeapFree(heap, ptrs[i]);
+
+    size_t trimmed = HeapTrim(heap);
+    printf("Trimmed %lu bytes\n", trimmed);
+    if (trimmed == 0 || GetMappedBytes(heap) != 0)
+    {
+        printf("Error: expected trimming to unmap everything, %lu bytes are still mapped\n", GetMappedBytes(heap));
+        ok = false;
+    }
+
+    // The heap is usable again once memory was released
+    void *ptr = HeapAlloc(heap, 100000);
+    if (!ptr)
+    {
+        printf("Error: could not allocate after freeing everything\n");
+        ok = false;
+    }
+
+    HeapFree(heap, ptr);
+    DestroyHeap(heap);
+
+    ok &= TestSpanChunkLimit();
+    ok &= TestGlobalHeapCreationFailure();
+
+    return ok ? 0 : 1;
+}
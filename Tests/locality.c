@@ -0,0 +1,38 @@
+#include "common.h"
+
+#define NUM_BLOCKS 20
+#define ALLOC_SIZE 64
+
+int main()
+{
+    struct MemoryHeap *heap = CreateHeap();
+
+    void *ptrs[NUM_BLOCKS];
+    for (int i = 0; i < NUM_BLOCKS; i += 1)
+        ptrs[i] = HeapAlloc(heap, ALLOC_SIZE);
+
+    // Free the first half in a scattered order
+    for (int i = 0; i < NUM_BLOCKS / 2; i += 1)
+        HeapFree(heap, ptrs[(i * 7) % (NUM_BLOCKS / 2)]);
+
+    // Freed blocks only come back once the blocks that were never allocated run out,
+    // so new allocations keep following each other in memory
+    void *prev = ptrs[NUM_BLOCKS - 1];
+    for (int i = 0; i < NUM_BLOCKS / 2; i += 1)
+    {
+        void *ptr = HeapAlloc(heap, ALLOC_SIZE);
+        if (ptr <= prev)
+        {
+            printf("Error: allocation %d at %p does not follow the previous one at %p\n", i, ptr, prev);
+            return 1;
+        }
+
+        prev = ptr;
+    }
+
+    printf("Allocations after frees stayed in address order\n");
+
+    DestroyHeap(heap);
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "common.h"
+
+#define NUM_BLOCKS 512
+#define BLOCK_SIZE 64
+#define PATTERN 0xa5
+
+static int ComparePointers(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *)a;
+    uintptr_t y = *(const uintptr_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Scans the pages whose every block is one of ptrs, which must be sorted.
+// Returns the number of pages scanned, or -1 if one of them contains anything but the pattern.
+static int ScanDataPages(void **ptrs, int count)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    int num_pages = 0;
+    int i = 0;
+    while (i < count)
+    {
+        uintptr_t page = (uintptr_t)ptrs[i] & ~(page_size - 1);
+        int num_in_page = 0;
+        while (i + num_in_page < count && ((uintptr_t)ptrs[i + num_in_page] & ~(page_size - 1)) == page)
+            num_in_page += 1;
+
+        if ((size_t)num_in_page == page_size / BLOCK_SIZE)
+        {
+            const unsigned char *bytes = (const unsigned char *)page;
+            for (size_t j = 0; j < page_size; j += 1)
+            {
+                if (bytes[j] != PATTERN)
+                {
+                    printf("Error: byte %lu of data page %p is 0x%02x, expected 0x%02x\n", j, (void *)page, bytes[j], PATTERN);
+                    return -1;
+                }
+            }
+
+            num_pages += 1;
+        }
+
+        i += num_in_page;
+    }
+
+    return num_pages;
+}
+
+int main()
+{
+#ifndef FT_MALLOC_OUT_OF_LINE_METADATA
+    printf("Skipped, the allocator was built without FT_MALLOC_OUT_OF_LINE_METADATA\n");
+    return 0;
+#endif
+
+    struct MemoryHeap *heap = CreateHeap();
+    SetHeapPoisonMode(heap, FT_MALLOC_POISON_OFF);
+
+    static void *ptrs[NUM_BLOCKS];
+    for (int i = 0; i < NUM_BLOCKS; i += 1)
+    {
+        ptrs[i] = HeapAlloc(heap, BLOCK_SIZE);
+        memset(ptrs[i], PATTERN, BLOCK_SIZE);
+    }
+
+    qsort(ptrs, NUM_BLOCKS, sizeof(*ptrs), ComparePointers);
+
+    // Pages filled with blocks must only contain user data, the headers and free lists live elsewhere
+    bool ok = true;
+    int num_pages = ScanDataPages(ptrs, NUM_BLOCKS);
+    if (num_pages == 0)
+        printf("Error: no data page was filled with blocks\n");
+    ok &= num_pages > 0;
+
+    for (int i = 0; i < NUM_BLOCKS; i += 2)
+        HeapFree(heap, ptrs[i]);
+
+    ok &= ScanDataPages(ptrs, NUM_BLOCKS) == num_pages;
+
+    printf("Scanned %d data pages\n", num_pages);
+
+    DestroyHeap(heap);
+
+    return ok ? 0 : 1;
+}
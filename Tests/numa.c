@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#define NUM_THREADS 4
+#define NUM_NODES 2
+#define NUM_ALLOCS 1000
+#define NUM_REAL_NODE_ALLOCS 16
+
+typedef struct ThreadResult
+{
+    int node;
+    void *ptrs[NUM_ALLOCS];
+} ThreadResult;
+
+static ThreadResult results[NUM_THREADS];
+
+#ifdef FT_MALLOC_NUMA_AWARE
+
+// Runs on the first CPU of each node, and checks the kernel placed the memory
+// of the arena of that CPU on the same node
+static bool TestRealNodes()
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        printf("Skipped the real node test, sched_getaffinity failed\n");
+        return true;
+    }
+
+    int cpu_per_node[FT_MALLOC_MAX_NUMA_NODES];
+    for (int i = 0; i < FT_MALLOC_MAX_NUMA_NODES; i += 1)
+        cpu_per_node[i] = -1;
+
+    int num_nodes = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu += 1)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        unsigned int current_cpu = 0;
+        unsigned int node = 0;
+        if (sched_setaffinity(0, sizeof(set), &set) != 0 || getcpu(&current_cpu, &node) != 0)
+            continue;
+
+        if (node < FT_MALLOC_MAX_NUMA_NODES && cpu_per_node[node] < 0)
+        {
+            cpu_per_node[node] = cpu;
+            num_nodes += 1;
+        }
+    }
+
+    bool ok = true;
+    if (num_nodes < 2)
+    {
+        printf("Skipped the real node test, found %d NUMA node\n", num_nodes);
+    }
+    else
+    {
+        for (int node = 0; node < FT_MALLOC_MAX_NUMA_NODES; node += 1)
+        {
+            if (cpu_per_node[node] < 0)
+                continue;
+
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu_per_node[node], &set);
+            sched_setaffinity(0, sizeof(set), &set);
+
+            void *ptrs[NUM_REAL_NODE_ALLOCS];
+            for (int i = 0; i < NUM_REAL_NODE_ALLOCS; i += 1)
+            {
+                size_t size = 100 + i * 4000;
+                ptrs[i] = Alloc(size);
+                memset(ptrs[i], i, size);
+
+                int alloc_node = GetAllocationNumaNode(ptrs[i]);
+                if (alloc_node != node)
+                {
+                    printf("Error: allocation of %lu bytes on CPU %d is on node %d, expected node %d\n",
+                        size, cpu_per_node[node], alloc_node, node);
+                    ok = false;
+                }
+            }
+
+            for (int i = 0; i < NUM_REAL_NODE_ALLOCS; i += 1)
+                Free(ptrs[i]);
+
+            printf("CPU %d allocated on node %d\n", cpu_per_node[node], node);
+        }
+    }
+
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+
+    return ok;
+}
+
+static void *ThreadMain(void *data)
+{
+    ThreadResult *result = (ThreadResult *)data;
+    result->node = -1;
+
+    for (int i = 0; i < NUM_ALLOCS; i += 1)
+    {
+        size_t size = GetRandomAllocSize() / 4;
+        result->ptrs[i] = Alloc(size);
+        memset(result->ptrs[i], i, size);
+
+        int node = GetAllocationNumaNode(result->ptrs[i]);
+        if (result->node < 0)
+            result->node = node;
+
+        if (node != result->node)
+        {
+            printf("Error: allocation %d is on node %d, expected node %d\n", i, node, result->node);
+            exit(1);
+        }
+    }
+
+    return NULL;
+}
+
+#endif
+
+int main()
+{
+#ifndef FT_MALLOC_NUMA_AWARE
+    printf("Skipped, the allocator was built without FT_MALLOC_NUMA_AWARE\n");
+    return 0;
+#else
+    // Arenas keep the node they were created on, so the real topology
+    // is tested in another process, before simulating one
+    pid_t pid = fork();
+    if (pid == 0)
+        exit(TestRealNodes() ? 0 : 1);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return 1;
+
+    SimulateNumaTopology(NUM_THREADS, NUM_NODES);
+
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i += 1)
+        pthread_create(&threads[i], NULL, ThreadMain, &results[i]);
+
+    for (int i = 0; i < NUM_THREADS; i += 1)
+        pthread_join(threads[i], NULL);
+
+    int num_threads_per_node[NUM_NODES] = {};
+    for (int i = 0; i < NUM_THREADS; i += 1)
+    {
+        printf("Thread %d allocated on node %d\n", i, results[i].node);
+        num_threads_per_node[results[i].node] += 1;
+    }
+
+    for (int i = 0; i < NUM_NODES; i += 1)
+    {
+        if (num_threads_per_node[i] != NUM_THREADS / NUM_NODES)
+        {
+            printf("Error: expected %d threads on node %d, got %d\n", NUM_THREADS / NUM_NODES, i, num_threads_per_node[i]);
+            return 1;
+        }
+    }
+
+    // Memory freed by this thread must go back to the arenas of the threads that allocated it
+    for (int i = 0; i < NUM_THREADS; i += 1)
+    {
+        for (int j = 0; j < NUM_ALLOCS; j += 1)
+            Free(results[i].ptrs[j]);
+    }
+
+    DestroyGlobalHeap();
+
+    return 0;
+#endif
+}
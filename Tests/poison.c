@@ -0,0 +1,195 @@
+#include "common.h"
+#include "../ft_malloc_inline.h"
+
+#define NUM_SLOTS 256
+#define NUM_ITERATIONS 500000
+#define NUM_RUNS 9
+
+static bool ExpectFilled(const char *name, const unsigned char *ptr, size_t size, unsigned char value)
+{
+    for (size_t i = 0; i < size; i += 1)
+    {
+        if (ptr[i] != value)
+        {
+            printf("Error: %s: expected byte %lu to be 0x%x, got 0x%x\n", name, i, value, ptr[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Freed memory stays mapped here: the bucket and the span chunk are kept
+// alive by other allocations, and the big allocation goes to the cache
+static bool TestFreePoisoning(struct MemoryHeap *heap)
+{
+    static const size_t Sizes[] = {40, 5000, 100000};
+
+    bool ok = true;
+    for (int i = 0; i < 3; i += 1)
+    {
+        void *keep_alive = HeapAlloc(heap, Sizes[i]);
+        unsigned char *ptr = HeapAlloc(heap, Sizes[i]);
+        memset(ptr, 0x11, Sizes[i]);
+        HeapFree(heap, ptr);
+
+        ok &= ExpectFilled("freed memory", ptr + sizeof(void *) * 2, Sizes[i] - sizeof(void *) * 2, FT_MALLOC_MEMORY_PATTERN_FREED);
+        HeapFree(heap, keep_alive);
+    }
+
+    // Only the requested bytes are filled, not the rest of the block
+    unsigned char *ptr = HeapAlloc(heap, 40);
+    void *keep_alive = HeapAlloc(heap, 40);
+    HeapFree(heap, ptr);
+    ok &= ExpectFilled("block tail", ptr + 40, 24, 0);
+    HeapFree(heap, keep_alive);
+
+    return ok;
+}
+
+// Only the start of freed memory is filled in bounded mode
+static bool TestBoundedPoisoning(struct MemoryHeap *heap)
+{
+    void *keep_alive = HeapAlloc(heap, 5000);
+    unsigned char *ptr = HeapAlloc(heap, 5000);
+    memset(ptr, 0x11, 5000);
+    HeapFree(heap, ptr);
+
+    bool ok = true;
+    ok &= ExpectFilled("bounded freed memory", ptr + sizeof(void *) * 2, FT_MALLOC_POISON_BOUNDED_SIZE - sizeof(void *) * 2, FT_MALLOC_MEMORY_PATTERN_FREED);
+    ok &= ExpectFilled("memory past the bound", ptr + FT_MALLOC_POISON_BOUNDED_SIZE, 5000 - FT_MALLOC_POISON_BOUNDED_SIZE, 0x11);
+    HeapFree(heap, keep_alive);
+
+    return ok;
+}
+
+static double MeasureAllocFree(struct MemoryHeap *heap)
+{
+    static const size_t Sizes[] = {16, 48, 100, 256, 700, 1600, 3000, 20000};
+    void *ptrs[NUM_SLOTS] = {};
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (int i = 0; i < NUM_ITERATIONS; i += 1)
+    {
+        int slot = (i * 7) % NUM_SLOTS;
+        HeapFree(heap, ptrs[slot]);
+
+        size_t size = Sizes[i % 8];
+        ptrs[slot] = HeapAlloc(heap, size);
+        memset(ptrs[slot], 1, size);
+    }
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    for (int i = 0; i < NUM_SLOTS; i += 1)
+        HeapFree(heap, ptrs[i]);
+
+    return ElapsedTimeMS(start_time, end_time);
+}
+
+// The thread cache fills blocks when they enter it. In full mode it hands out
+// blocks one at a time, so they always get the allocated pattern.
+static bool TestInlinePoisoning(int mode)
+{
+    void *keep_alive = InlineAlloc(40);
+
+    bool ok = true;
+    for (int i = 0; i < 100; i += 1)
+    {
+        unsigned char *ptr = InlineAlloc(40);
+        if (mode == FT_MALLOC_POISON_FULL)
+            ok &= ExpectFilled("inline allocated memory", ptr, 40, FT_MALLOC_MEMORY_PATTERN_ALLOCATED_UNTOUCHED);
+
+        memset(ptr, 0x11, 40);
+        InlineFree(ptr);
+        ok &= ExpectFilled("inline freed memory", ptr + sizeof(void *) * 2, 40 - sizeof(void *) * 2, FT_MALLOC_MEMORY_PATTERN_FREED);
+    }
+
+    InlineFree(keep_alive);
+    FlushThreadCache();
+
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    // The global heaps take their mode from FT_MALLOC_CONF, which is read once,
+    // so the inline tests run again in a new process for each mode
+    const char *conf = getenv("FT_MALLOC_CONF");
+    if (conf)
+    {
+        printf("FT_MALLOC_CONF=%s\n", conf);
+        if (strcmp(conf, "poison:free") == 0)
+        {
+            if (!TestInlinePoisoning(FT_MALLOC_POISON_FREE))
+                return 1;
+
+            char *env[] = {"FT_MALLOC_CONF=poison:full", NULL};
+            fflush(stdout);
+            execve("/proc/self/exe", argv, env);
+            perror("execve");
+
+            return 1;
+        }
+
+        return TestInlinePoisoning(FT_MALLOC_POISON_FULL) ? 0 : 1;
+    }
+
+    struct MemoryHeap *heap = CreateHeap();
+    HeapReserve(heap, 100000, 1);
+
+    bool ok = true;
+
+    SetHeapPoisonMode(heap, FT_MALLOC_POISON_BOUNDED);
+    ok &= TestBoundedPoisoning(heap);
+
+    SetHeapPoisonMode(heap, FT_MALLOC_POISON_FREE);
+    ok &= TestFreePoisoning(heap);
+
+    SetHeapPoisonMode(heap, FT_MALLOC_POISON_FULL);
+    ok &= TestFreePoisoning(heap);
+
+    // Reused memory is filled when it is allocated, fresh memory reads as zero
+    unsigned char *ptr = HeapAlloc(heap, 40);
+    ok &= ExpectFilled("allocated memory", ptr, 40, FT_MALLOC_MEMORY_PATTERN_ALLOCATED_UNTOUCHED);
+    HeapFree(heap, ptr);
+
+    ptr = HeapAlloc(heap, 10 * 1024 * 1024);
+    ok &= ExpectFilled("fresh big allocation", ptr, 10 * 1024 * 1024, 0);
+    HeapFree(heap, ptr);
+
+    // Modes are measured in turns and the best run of each is kept, so noise
+    // from the rest of the machine affects all of them the same way
+    double times[4] = {};
+    for (int run = 0; run < NUM_RUNS; run += 1)
+    {
+        for (int mode = FT_MALLOC_POISON_OFF; mode <= FT_MALLOC_POISON_FULL; mode += 1)
+        {
+            SetHeapPoisonMode(heap, mode);
+            double time = MeasureAllocFree(heap);
+            if (run == 0 || time < times[mode])
+                times[mode] = time;
+        }
+    }
+
+    printf("Poisoning off %.2f ms, bounded %.2f ms (%+.1f%%), free %.2f ms (%+.1f%%), full %.2f ms (%+.1f%%)\n",
+        times[0], times[1], (times[1] / times[0] - 1) * 100, times[2], (times[2] / times[0] - 1) * 100,
+        times[3], (times[3] / times[0] - 1) * 100);
+
+    DestroyHeap(heap);
+
+    if (!ok)
+        return 1;
+
+    char *env[] = {"FT_MALLOC_CONF=poison:free", NULL};
+    fflush(stdout);
+    execve("/proc/self/exe", argv, env);
+    perror("execve");
+
+    return 1;
+}
@@ -0,0 +1,255 @@
+#include "common.h"
+
+#include <pthread.h>
+
+#define NUM_ROUNDS 5
+#define WORKING_SET_SIZE (512 * 1024)
+#define COPY_SIZE (32 * 1024 * 1024)
+#define CONCURRENT_WORKING_SET_SIZE (8 * 1024 * 1024)
+#define CONCURRENT_COPY_SIZE (64 * 1024 * 1024 + 37)
+
+static unsigned char working_set[WORKING_SET_SIZE];
+
+static bool CheckPattern(const unsigned char *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i += 4093)
+    {
+        if (ptr[i] != (unsigned char)(i * 7))
+            return false;
+    }
+
+    return ptr[size - 1] == (unsigned char)((size - 1) * 7);
+}
+
+static void FillPattern(unsigned char *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i += 4093)
+        ptr[i] = (unsigned char)(i * 7);
+
+    ptr[size - 1] = (unsigned char)((size - 1) * 7);
+}
+
+// The destination is reserved and prefaulted, so both copies write to memory that is
+// already mapped. Sizes are odd so the copies have unaligned tails.
+static unsigned char *AllocMovingBuffer(struct MemoryHeap *heap, size_t size)
+{
+    unsigned char *ptr = HeapAlloc(heap, size);
+    memset(ptr, 1, size);
+    FillPattern(ptr, size);
+
+    HeapReserve(heap, size * 2, 1);
+    HeapPrefault(heap, 0);
+
+    return ptr;
+}
+
+static bool TestThroughput(size_t size)
+{
+    float memcpy_ms = 0;
+    float realloc_ms = 0;
+
+    for (int round = 0; round < NUM_ROUNDS; round += 1)
+    {
+        struct MemoryHeap *heap = CreateHeap();
+        unsigned char *src = AllocMovingBuffer(heap, size);
+
+        unsigned char *dst = HeapAlloc(heap, size * 2);
+        memset(dst, 0, size * 2);
+
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        memcpy(dst, src, size);
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        memcpy_ms += ElapsedTimeMS(start_time, end_time);
+
+        // Put the destination back in the reserve, growing past the mapped pages
+        // always moves the allocation there
+        HeapFree(heap, dst);
+
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+        src = HeapRealloc(heap, src, size * 2);
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+        realloc_ms += ElapsedTimeMS(start_time, end_time);
+
+        bool ok = CheckPattern(src, size);
+        DestroyHeap(heap);
+
+        if (!ok)
+        {
+            printf("Error: data was not preserved by realloc of %lu bytes\n", size);
+            return false;
+        }
+    }
+
+    printf("%9lu bytes: memcpy %8.1f MB/s, HeapRealloc %8.1f MB/s\n", size,
+        size * NUM_ROUNDS / 1024.0 / 1024.0 / (memcpy_ms / 1000.0),
+        size * NUM_ROUNDS / 1024.0 / 1024.0 / (realloc_ms / 1000.0));
+
+    return true;
+}
+
+static unsigned int ScanWorkingSet()
+{
+    unsigned int sum = 0;
+    for (size_t i = 0; i < WORKING_SET_SIZE; i += 64)
+        sum += working_set[i];
+
+    return sum;
+}
+
+static float TimeWorkingSetScan()
+{
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    volatile unsigned int sum = ScanWorkingSet();
+    (void)sum;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    return ElapsedTimeMS(start_time, end_time) * 1000;
+}
+
+// A program keeps scanning its working set while buffers are moved around.
+// Copies that go through the cache evict the working set, the next scan misses.
+static void TestCacheImpact()
+{
+    memset(working_set, 1, WORKING_SET_SIZE);
+
+    float memcpy_us = 0;
+    float realloc_us = 0;
+    float warm_us = 0;
+
+    for (int round = 0; round < NUM_ROUNDS; round += 1)
+    {
+        struct MemoryHeap *heap = CreateHeap();
+        unsigned char *src = AllocMovingBuffer(heap, COPY_SIZE);
+        unsigned char *dst = HeapAlloc(heap, COPY_SIZE * 2);
+        memset(dst, 0, COPY_SIZE * 2);
+
+        ScanWorkingSet();
+        warm_us += TimeWorkingSetScan();
+
+        memcpy(dst, src, COPY_SIZE);
+        memcpy_us += TimeWorkingSetScan();
+
+        HeapFree(heap, dst);
+        ScanWorkingSet();
+        src = HeapRealloc(heap, src, COPY_SIZE * 2);
+        realloc_us += TimeWorkingSetScan();
+
+        DestroyHeap(heap);
+    }
+
+    printf("Working set scan: warm %.1f us, after memcpy %.1f us, after HeapRealloc %.1f us\n",
+        warm_us / NUM_ROUNDS, memcpy_us / NUM_ROUNDS, realloc_us / NUM_ROUNDS);
+}
+
+typedef struct Reader
+{
+    const unsigned char *working_set;
+    volatile bool copying;
+    volatile bool stop;
+    size_t num_scans;
+    float scan_us;
+} Reader;
+
+// Keeps re-reading its working set, only the scans that happen entirely
+// while the main thread copies are counted
+static void *ReaderMain(void *data)
+{
+    Reader *reader = data;
+    while (!reader->stop)
+    {
+        bool copying = reader->copying;
+
+        struct timespec start_time, end_time;
+        clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+        volatile unsigned int sum = 0;
+        for (size_t i = 0; i < CONCURRENT_WORKING_SET_SIZE; i += 64)
+            sum += reader->working_set[i];
+        (void)sum;
+
+        clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+        if (copying && reader->copying)
+        {
+            reader->scan_us += ElapsedTimeMS(start_time, end_time) * 1000;
+            reader->num_scans += 1;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the average time of the reader's scans while buffers are copied,
+// with memcpy or with HeapRealloc
+static float MeasureConcurrentScans(const unsigned char *working_set, bool use_realloc)
+{
+    Reader reader = {.working_set = working_set};
+    pthread_t thread;
+    pthread_create(&thread, NULL, ReaderMain, &reader);
+
+    for (int round = 0; round < NUM_ROUNDS; round += 1)
+    {
+        struct MemoryHeap *heap = CreateHeap();
+        unsigned char *src = AllocMovingBuffer(heap, CONCURRENT_COPY_SIZE);
+        unsigned char *dst = HeapAlloc(heap, CONCURRENT_COPY_SIZE * 2);
+        memset(dst, 0, CONCURRENT_COPY_SIZE * 2);
+        if (use_realloc)
+            HeapFree(heap, dst);
+
+        reader.copying = true;
+        if (use_realloc)
+            src = HeapRealloc(heap, src, CONCURRENT_COPY_SIZE * 2);
+        else
+            memcpy(dst, src, CONCURRENT_COPY_SIZE);
+        reader.copying = false;
+
+        DestroyHeap(heap);
+    }
+
+    reader.stop = true;
+    pthread_join(thread, NULL);
+
+    return reader.num_scans > 0 ? reader.scan_us / reader.num_scans : 0;
+}
+
+// Same as TestCacheImpact, with the working set read by another thread during the copies
+static void TestConcurrentCacheImpact()
+{
+    unsigned char *working_set = malloc(CONCURRENT_WORKING_SET_SIZE);
+    memset(working_set, 1, CONCURRENT_WORKING_SET_SIZE);
+
+    float memcpy_us = MeasureConcurrentScans(working_set, false);
+    float realloc_us = MeasureConcurrentScans(working_set, true);
+
+    printf("Concurrent working set scan: during memcpy %.1f us, during HeapRealloc %.1f us\n", memcpy_us, realloc_us);
+
+    free(working_set);
+}
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+
+    // Non temporal copies are off by default
+    if (!getenv("FT_MALLOC_CONF"))
+    {
+        char *env[] = {"FT_MALLOC_CONF=non_temporal_threshold:4m", NULL};
+        execve("/proc/self/exe", argv, env);
+        perror("execve");
+
+        return 1;
+    }
+
+    bool ok = true;
+    ok &= TestThroughput(100 * 1024 + 37);
+    ok &= TestThroughput(1024 * 1024 + 37);
+    ok &= TestThroughput(16 * 1024 * 1024 + 37);
+    ok &= TestThroughput(64 * 1024 * 1024 + 37);
+
+    TestCacheImpact();
+    TestConcurrentCacheImpact();
+
+    return ok ? 0 : 1;
+}
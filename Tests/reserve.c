@@ -0,0 +1,95 @@
+#include "common.h"
+
+#include <sys/resource.h>
+
+#define NUM_SMALL 1000
+#define NUM_MID 100
+#define NUM_BIG 4
+#define NUM_ROUNDS 10
+
+static bool Expect(const char *name, size_t value, size_t expected)
+{
+    if (value == expected)
+        return true;
+
+    printf("Error: expected %s to be %lu, got %lu\n", name, expected, value);
+
+    return false;
+}
+
+static long GetMinorFaults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_minflt;
+}
+
+int main()
+{
+    struct MemoryHeap *heap = CreateHeap();
+
+    bool ok = true;
+    ok &= Expect("small reserve result", HeapReserve(heap, 40, NUM_SMALL), 0);
+    ok &= Expect("mid reserve result", HeapReserve(heap, 2000, NUM_MID), 0);
+    ok &= Expect("big reserve result", HeapReserve(heap, 100000, NUM_BIG), 0);
+
+    // Locking may not be allowed, the pages are still populated in that case
+    if (HeapPrefault(heap, FT_MALLOC_PREFAULT_LOCK | FT_MALLOC_PREFAULT_NEW_MEMORY) != 0)
+        printf("Could not lock the heap in memory (%s)\n", strerror(errno));
+
+    HeapLayout reserved;
+    GetHeapLayout(heap, &reserved);
+    PrintHeapLayout(&reserved);
+
+    void *small[NUM_SMALL];
+    void *mid[NUM_MID];
+    void *big[NUM_BIG];
+
+    long faults = GetMinorFaults();
+
+    // The hot loop must not map any memory
+    for (int round = 0; round < NUM_ROUNDS; round += 1)
+    {
+        for (int i = 0; i < NUM_SMALL; i += 1)
+            small[i] = HeapAlloc(heap, 40);
+        for (int i = 0; i < NUM_MID; i += 1)
+            mid[i] = HeapAlloc(heap, 2000);
+        for (int i = 0; i < NUM_BIG; i += 1)
+            big[i] = HeapAlloc(heap, 100000);
+
+        for (int i = 0; i < NUM_SMALL; i += 1)
+            HeapFree(heap, small[i]);
+        for (int i = 0; i < NUM_MID; i += 1)
+            HeapFree(heap, mid[i]);
+        for (int i = 0; i < NUM_BIG; i += 1)
+            HeapFree(heap, big[i]);
+    }
+
+    printf("Minor page faults during the hot loop: %ld\n", GetMinorFaults() - faults);
+
+    HeapLayout layout;
+    GetHeapLayout(heap, &layout);
+    ok &= Expect("buckets", layout.num_buckets, reserved.num_buckets);
+    ok &= Expect("span chunks", layout.num_span_chunks, reserved.num_span_chunks);
+    ok &= Expect("cached big allocations", layout.num_big_cached, NUM_BIG);
+    ok &= Expect("mapped bytes", layout.mapped_bytes, reserved.mapped_bytes);
+
+    // Trimming keeps what is reserved
+    HeapTrim(heap);
+    GetHeapLayout(heap, &layout);
+    ok &= Expect("cached big allocations after trimming", layout.num_big_cached, NUM_BIG);
+
+    // Without a reserve, freed memory is given back as usual
+    HeapReserve(heap, 100000, 0);
+    void *ptr = HeapAlloc(heap, 100000);
+    HeapFree(heap, ptr);
+
+    GetHeapLayout(heap, &layout);
+    ok &= Expect("cached big allocations after clearing the reserve", layout.num_big_cached, 0);
+    ok &= Expect("big mapped bytes after clearing the reserve", layout.big_mapped_bytes, 0);
+
+    DestroyHeap(heap);
+
+    return ok ? 0 : 1;
+}
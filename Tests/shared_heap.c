@@ -0,0 +1,229 @@
+#include "common.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#define SHARED_HEAP_SIZE (64 * 1024 * 1024)
+#define NUM_MESSAGES 2000
+#define MAX_KILL_ATTEMPTS 1000
+
+static const size_t Sizes[] = {40, 300, 1500, 4000, 20000, 100000};
+static const int Num_Sizes = sizeof(Sizes) / sizeof(*Sizes);
+
+// Messages start with their size and are filled with their index
+static void *CreateMessage(struct MemoryHeap *heap, int index)
+{
+    size_t size = Sizes[index % Num_Sizes];
+    unsigned char *message = SharedHeapAlloc(heap, size);
+    memset(message, index, size);
+    *(size_t *)message = size;
+
+    return message;
+}
+
+static bool CheckMessage(const unsigned char *message, int index)
+{
+    size_t size = *(const size_t *)message;
+    if (size != Sizes[index % Num_Sizes] || message[size - 1] != (unsigned char)index)
+    {
+        printf("Error: message %d was not received correctly\n", index);
+        return false;
+    }
+
+    return true;
+}
+
+static void SendOffset(int fd, size_t offset)
+{
+    ssize_t n = write(fd, &offset, sizeof(size_t));
+    assert(n == sizeof(size_t));
+}
+
+static bool ReceiveOffset(int fd, size_t *offset)
+{
+    return read(fd, offset, sizeof(size_t)) == sizeof(size_t);
+}
+
+// Reads the messages of the parent, frees them, and answers each with a message of its own
+static int RunChild(struct MemoryHeap *heap, int in, int out)
+{
+    bool ok = true;
+    size_t offset;
+    for (int i = 0; ReceiveOffset(in, &offset); i += 1)
+    {
+        unsigned char *message = GetHeapPointer(heap, offset);
+        ok &= CheckMessage(message, i);
+
+        // Growing the message must keep its content
+        message = SharedHeapRealloc(heap, message, *(size_t *)message * 2);
+        ok &= message != NULL && CheckMessage(message, i);
+        SharedHeapFree(heap, message);
+
+        SendOffset(out, GetHeapOffset(heap, CreateMessage(heap, i + 1)));
+    }
+
+    DestroyHeap(heap);
+
+    return ok ? 0 : 1;
+}
+
+// Kills children while they allocate and free until one dies holding the lock,
+// after which the heap must refuse to be used in every process
+static bool TestOwnerDeath()
+{
+    int fd;
+    struct MemoryHeap *heap = CreateSharedHeap(SHARED_HEAP_SIZE, &fd);
+    if (!heap)
+        return false;
+
+    bool dead = false;
+    for (int attempt = 0; attempt < MAX_KILL_ATTEMPTS && !dead; attempt += 1)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            for (int i = 0;; i += 1)
+                SharedHeapFree(heap, SharedHeapAlloc(heap, Sizes[i % Num_Sizes]));
+        }
+
+        usleep(1000);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        void *ptr = SharedHeapAlloc(heap, 100);
+        if (ptr)
+            SharedHeapFree(heap, ptr);
+        else
+            dead = errno == ENOTRECOVERABLE;
+    }
+
+    bool ok = true;
+    if (!dead)
+    {
+        printf("Error: expected the heap to be unusable after its lock owner died\n");
+        ok = false;
+    }
+    else if (SharedHeapAlloc(heap, 100) || errno != ENOTRECOVERABLE
+        || SharedHeapRealloc(heap, NULL, 100) || errno != ENOTRECOVERABLE)
+    {
+        printf("Error: expected the heap to stay unusable\n");
+        ok = false;
+    }
+
+    DestroyHeap(heap);
+    close(fd);
+
+    return ok;
+}
+
+int main()
+{
+    int fd;
+    struct MemoryHeap *heap = CreateSharedHeap(SHARED_HEAP_SIZE, &fd);
+    if (!heap && errno == ENOTSUP)
+    {
+        printf("Shared heaps are not supported in this configuration\n");
+        return 0;
+    }
+    if (!heap)
+    {
+        printf("Error: could not create the shared heap (%s)\n", strerror(errno));
+        return 1;
+    }
+
+    // The callback could be called from another process
+    if (SetHeapPressureCallback(heap, NULL, NULL) != -1 || errno != ENOTSUP)
+    {
+        printf("Error: expected pressure callbacks to be rejected on shared heaps\n");
+        return 1;
+    }
+
+    int to_child[2];
+    int to_parent[2];
+    if (pipe(to_child) != 0 || pipe(to_parent) != 0)
+        return 1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(to_child[1]);
+        close(to_parent[0]);
+        exit(RunChild(heap, to_child[0], to_parent[1]));
+    }
+
+    close(to_child[0]);
+    close(to_parent[1]);
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    bool ok = true;
+    for (int i = 0; i < NUM_MESSAGES; i += 1)
+    {
+        SendOffset(to_child[1], GetHeapOffset(heap, CreateMessage(heap, i)));
+
+        size_t offset;
+        if (!ReceiveOffset(to_parent[0], &offset))
+        {
+            printf("Error: the child process stopped answering\n");
+            ok = false;
+            break;
+        }
+
+        unsigned char *answer = GetHeapPointer(heap, offset);
+        ok &= CheckMessage(answer, i + 1);
+        SharedHeapFree(heap, answer);
+    }
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    close(to_child[1]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("Error: the child process failed\n");
+        ok = false;
+    }
+
+    printf("%d round trips in %.2f ms\n", NUM_MESSAGES, ElapsedTimeMS(start_time, end_time));
+
+    // Another process could attach the heap with fd, attaching it here works the same way
+    struct MemoryHeap *attached = AttachSharedHeap(fd);
+    if (attached || errno != EEXIST)
+    {
+        printf("Error: expected attaching the heap at an address in use to fail with EEXIST\n");
+        ok = false;
+    }
+
+    HeapLayout layout;
+    GetHeapLayout(heap, &layout);
+    if (layout.num_allocations != 0)
+    {
+        printf("Error: expected every message to be freed, %lu allocations left\n", layout.num_allocations);
+        ok = false;
+    }
+
+    DestroyHeap(heap);
+
+    // Once detached, the heap can be attached again from its descriptor
+    heap = AttachSharedHeap(fd);
+    if (!heap)
+    {
+        printf("Error: could not attach the shared heap (%s)\n", strerror(errno));
+        return 1;
+    }
+
+    void *ptr = SharedHeapAlloc(heap, 100);
+    ok &= ptr != NULL;
+    SharedHeapFree(heap, ptr);
+
+    DestroyHeap(heap);
+    close(fd);
+
+    ok &= TestOwnerDeath();
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+#include "common.h"
+
+#include <pthread.h>
+
+#define NUM_THREADS 8
+#define NUM_ITERATIONS 10000
+#define NUM_SHARED_SLOTS 256
+
+// Pointers are exchanged between threads through these slots,
+// so memory is often freed by another thread than the one that allocated it
+static void *shared_slots[NUM_SHARED_SLOTS];
+
+// Tests are built without optimizations, so we only check one byte per cache line
+static bool FillAndCheck(unsigned char *ptr, size_t size, unsigned char pattern, bool check)
+{
+    if (!check)
+    {
+        memset(ptr, pattern, size);
+        return true;
+    }
+
+    for (size_t i = 0; i < size; i += 64)
+    {
+        if (ptr[i] != pattern)
+            return false;
+    }
+
+    return size == 0 || ptr[size - 1] == pattern;
+}
+
+static size_t GetThreadAllocSize(unsigned int *seed)
+{
+    static const size_t Sizes[] = {
+        16, 32, 48, 100, 512, 1600, 1601, 4000, 20000, 65536, 65537, 200000
+    };
+    static const int Num_Sizes = sizeof(Sizes) / sizeof(*Sizes);
+
+    return Sizes[rand_r(seed) % Num_Sizes];
+}
+
+// Allocations start with their size, the rest is filled with a pattern derived from it
+static unsigned char *AllocAndFill(unsigned char *ptr, size_t size)
+{
+    size_t old_size = ptr ? *(size_t *)ptr : 0;
+
+    ptr = Realloc(ptr, sizeof(size_t) + size);
+    if (!ptr)
+    {
+        printf("Could not allocate %lu bytes (%s)\n", sizeof(size_t) + size, strerror(errno));
+        exit(1);
+    }
+
+    if (old_size > 0 && !FillAndCheck(ptr + sizeof(size_t), old_size < size ? old_size : size, (unsigned char)old_size, true))
+    {
+        printf("Error: memory was corrupted by Realloc\n");
+        exit(1);
+    }
+
+    *(size_t *)ptr = size;
+    FillAndCheck(ptr + sizeof(size_t), size, (unsigned char)size, false);
+
+    return ptr;
+}
+
+static void *ThreadMain(void *data)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)data;
+
+    for (int i = 0; i < NUM_ITERATIONS; i += 1)
+    {
+        unsigned char *ptr = AllocAndFill(NULL, GetThreadAllocSize(&seed));
+        if (rand_r(&seed) % 4 == 0)
+            ptr = AllocAndFill(ptr, GetThreadAllocSize(&seed));
+
+        int slot = rand_r(&seed) % NUM_SHARED_SLOTS;
+        unsigned char *other = __atomic_exchange_n(&shared_slots[slot], ptr, __ATOMIC_ACQ_REL);
+        if (other)
+        {
+            size_t size = *(size_t *)other;
+            if (!FillAndCheck(other + sizeof(size_t), size, (unsigned char)size, true))
+            {
+                printf("Error: memory was corrupted\n");
+                exit(1);
+            }
+
+            Free(other);
+        }
+    }
+
+    return NULL;
+}
+
+int main()
+{
+#ifndef FT_MALLOC_PER_CPU_ARENAS
+    printf("Skipped, the allocator was built without FT_MALLOC_PER_CPU_ARENAS\n");
+    return 0;
+#endif
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i += 1)
+        pthread_create(&threads[i], NULL, ThreadMain, (void *)(uintptr_t)(i + 1));
+
+    for (int i = 0; i < NUM_THREADS; i += 1)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < NUM_SHARED_SLOTS; i += 1)
+        Free(shared_slots[i]);
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    printf("ft_malloc(threads=%d, N=%d) elapsed: %f ms\n", NUM_THREADS, NUM_ITERATIONS, ElapsedTimeMS(start_time, end_time));
+
+    DestroyGlobalHeap();
+
+    return 0;
+}
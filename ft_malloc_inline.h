@@ -0,0 +1,81 @@
+#ifndef FT_MALLOC_INLINE_H
+#define FT_MALLOC_INLINE_H
+
+#include "malloc.h"
+
+// Optional fast path on top of Alloc and Free. Each thread keeps a cache of free
+// blocks per small size class, and InlineAlloc pops from it without taking any
+// lock or calling into the library. Blocks in a cache are still allocated from
+// the point of view of their bucket, and heap layouts count them as such.
+//
+// Memory from InlineAlloc can be given to Free and Realloc, and InlineFree accepts
+// any pointer returned by Alloc or Realloc. A thread's cache is flushed when it
+// exits, DestroyGlobalHeap only flushes the cache of the calling thread.
+//
+// Build the library with `make lto` to also inline the slow paths into programs
+// compiled and linked with -flto.
+
+#define FT_MALLOC_THREAD_CACHE_CAPACITY 64
+#define FT_MALLOC_THREAD_CACHE_REFILL_COUNT 16
+
+static_assert(FT_MALLOC_THREAD_CACHE_REFILL_COUNT > 0 && FT_MALLOC_THREAD_CACHE_REFILL_COUNT <= FT_MALLOC_THREAD_CACHE_CAPACITY, "Invalid thread cache refill count");
+
+typedef struct ThreadCacheBin
+{
+    // Singly linked through the first bytes of each free block
+    void *free_list;
+    int count;
+} ThreadCacheBin;
+
+typedef struct ThreadCache
+{
+    ThreadCacheBin bins[FT_MALLOC_NUM_SMALL_SIZE_CLASS];
+    int registered;
+} ThreadCache;
+
+extern __thread ThreadCache thread_cache __attribute__((tls_model("initial-exec")));
+
+void *ThreadCacheAlloc(size_t size);
+void ThreadCacheFree(void *ptr);
+void FlushThreadCache();
+
+// Set while a tracer is attached to the alloc_sample probe, see Source/probes.h
+extern volatile unsigned short ft_malloc_alloc_sample_semaphore;
+void ProbeThreadCacheAlloc(void *ptr, size_t size);
+
+static inline __attribute__((always_inline)) void *InlineAlloc(size_t size)
+{
+    // A size of 0 wraps around and takes the slow path
+    if (__builtin_expect(size - 1 < FT_MALLOC_MAX_SMALL_SIZE, 1))
+    {
+        size_t size_class = 0;
+        if (size > FT_MALLOC_MIN_SIZE)
+            size_class = (size - FT_MALLOC_MIN_SIZE + FT_MALLOC_SMALL_SIZE_GRANULARITY - 1) / FT_MALLOC_SMALL_SIZE_GRANULARITY;
+
+        ThreadCacheBin *bin = &thread_cache.bins[size_class];
+        void *ptr = bin->free_list;
+        if (__builtin_expect(ptr != NULL, 1))
+        {
+            bin->free_list = *(void **)ptr;
+            bin->count -= 1;
+
+            if (__builtin_expect(ft_malloc_alloc_sample_semaphore != 0, 0))
+                ProbeThreadCacheAlloc(ptr, size);
+
+            return ptr;
+        }
+    }
+
+    return ThreadCacheAlloc(size);
+}
+
+// Finding the size class of ptr requires the allocator's internals,
+// so only the NULL check is inlined. The rest does not take any lock
+// unless the cache is full.
+static inline __attribute__((always_inline)) void InlineFree(void *ptr)
+{
+    if (ptr != NULL)
+        ThreadCacheFree(ptr);
+}
+
+#endif
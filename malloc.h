@@ -13,11 +13,23 @@ static_assert(sizeof(size_t) == 8, "Expected size_t to be 64 bits");
 // This is not a concrete limit, just an ideal virtual limit
 #define FT_MALLOC_MAX_SIZE 0x7ffffffffffffff0
 
+// Poisoning fills the bytes of allocations with a pattern when they are freed, and
+// optionally when they are allocated, so reads of freed or uninitialized memory stand out.
+// Only the requested bytes are filled. Memory fresh from the system reads as zero instead.
+// The mode is set per heap with SetHeapPoisonMode, new heaps start with the poison option
+// of FT_MALLOC_CONF (off, bounded, free or full). Define FT_MALLOC_POISON_MEMORY to default to full.
+// The bounded mode only fills the first FT_MALLOC_POISON_BOUNDED_SIZE bytes of freed memory,
+// which is where most stale pointers point, at a fraction of the cost.
+#define FT_MALLOC_POISON_OFF 0
+#define FT_MALLOC_POISON_BOUNDED 1
+#define FT_MALLOC_POISON_FREE 2
+#define FT_MALLOC_POISON_FULL 3
+#define FT_MALLOC_POISON_BOUNDED_SIZE 64
 // #define FT_MALLOC_POISON_MEMORY
-#define FT_MALLOC_MEMORY_PATTERN_NEVER_ALLOCATED 0xfe
 #define FT_MALLOC_MEMORY_PATTERN_ALLOCATED_UNTOUCHED 0xce
 #define FT_MALLOC_MEMORY_PATTERN_FREED 0xcd
 
+// Define FT_MALLOC_MIN_ALLOC_CAPACITY to give every bucket the same capacity
 // #ifndef FT_MALLOC_MIN_ALLOC_CAPACITY
 // #define FT_MALLOC_MIN_ALLOC_CAPACITY 100
 // #endif
@@ -26,27 +38,185 @@ static_assert(sizeof(size_t) == 8, "Expected size_t to be 64 bits");
 static_assert(FT_MALLOC_MIN_ALLOC_CAPACITY > 0, "Invalid value for FT_MALLOC_MIN_ALLOC_CAPACITY");
 #endif
 
+// Otherwise the capacity adapts to the demand of each size class: the first bucket
+// of a class has room for FT_MALLOC_MIN_BUCKET_CAPACITY allocations (rounded up to
+// whole pages), and each new bucket doubles it up to FT_MALLOC_MAX_BUCKET_CAPACITY.
+// The capacity is halved every time a bucket is released for being empty.
+#define FT_MALLOC_MIN_BUCKET_CAPACITY 8
+#define FT_MALLOC_MAX_BUCKET_CAPACITY 4096
+
+static_assert(FT_MALLOC_MIN_BUCKET_CAPACITY > 0 && FT_MALLOC_MIN_BUCKET_CAPACITY <= FT_MALLOC_MAX_BUCKET_CAPACITY, "Invalid bucket capacity limits");
+
 #define FT_MALLOC_SMALL_SIZE_GRANULARITY 32
 #define FT_MALLOC_NUM_SMALL_SIZE_CLASS 50
 #define FT_MALLOC_MIN_SMALL_SIZE FT_MALLOC_MIN_SIZE
 #define FT_MALLOC_MAX_SMALL_SIZE (FT_MALLOC_MIN_SMALL_SIZE + FT_MALLOC_SMALL_SIZE_GRANULARITY * (FT_MALLOC_NUM_SMALL_SIZE_CLASS - 1))
 
-#define FT_MALLOC_MID_SIZE_GRANULARITY 256
-#define FT_MALLOC_NUM_MID_SIZE_CLASS 20
-#define FT_MALLOC_MIN_MID_SIZE  (FT_MALLOC_MAX_SMALL_SIZE + 1)
-#define FT_MALLOC_MAX_MID_SIZE (FT_MALLOC_MAX_SMALL_SIZE + FT_MALLOC_MID_SIZE_GRANULARITY * FT_MALLOC_NUM_MID_SIZE_CLASS)
+// Mid sizes are served from runs of span pages carved out of big aligned chunks.
+// Span pages are smaller than OS pages to keep rounding waste low.
+#define FT_MALLOC_SPAN_PAGE_SIZE 256
+#define FT_MALLOC_SPAN_CHUNK_SIZE (1024 * 1024)
+#define FT_MALLOC_MIN_MID_SIZE (FT_MALLOC_MAX_SMALL_SIZE + 1)
+#define FT_MALLOC_MAX_MID_SIZE (64 * 1024)
+
+static_assert((FT_MALLOC_SPAN_CHUNK_SIZE & (FT_MALLOC_SPAN_CHUNK_SIZE - 1)) == 0, "FT_MALLOC_SPAN_CHUNK_SIZE must be a power of two");
+static_assert(FT_MALLOC_SPAN_CHUNK_SIZE / FT_MALLOC_SPAN_PAGE_SIZE <= 0x7fff, "Too many span pages per chunk");
 
 #define FT_MALLOC_MIN_BIG_SIZE (FT_MALLOC_MAX_MID_SIZE + 1)
 
-#define FT_MALLOC_NUM_SIZE_CLASS (FT_MALLOC_NUM_SMALL_SIZE_CLASS + FT_MALLOC_NUM_MID_SIZE_CLASS)
+#define FT_MALLOC_NUM_SIZE_CLASS FT_MALLOC_NUM_SMALL_SIZE_CLASS
+
+// Reallocs that move at least this many bytes, and poisoning fills of that size,
+// use non temporal stores so they do not evict the rest of the program's data from the cache.
+// Off by default, Tests/realloc_performance showed no win over memcpy, even for a thread
+// reading its working set during the copy. Enable it with FT_MALLOC_CONF="non_temporal_threshold:4m"
+#define FT_MALLOC_NON_TEMPORAL_THRESHOLD SIZE_MAX
+
+// Number of freed big allocations each heap keeps mapped for reuse, up to a mapping size
+// of FT_MALLOC_BIG_CACHE_MAX_SIZE. HeapReserve replaces these for the heap it is called on.
+#define FT_MALLOC_BIG_CACHE_CAPACITY 0
+#define FT_MALLOC_BIG_CACHE_MAX_SIZE (4 * 1024 * 1024)
+
+// The bucket capacities, the thread cache capacity, the big cache and the
+// non temporal threshold can be changed at startup with the FT_MALLOC_CONF
+// environment variable, which is read when the first heap is created.
+// It is a comma separated list of name:value options, values accept a k, m or g suffix:
+// FT_MALLOC_CONF="min_bucket_capacity:64,max_bucket_capacity:1024,big_cache_capacity:8,big_cache_max_size:16m"
+// Other options are thread_cache_capacity, non_temporal_threshold, poison, guarded_sample_rate,
+// guarded_slots, and stats:1 to print the layout of the global heap when the program exits.
+
+// On average one in FT_MALLOC_GUARDED_SAMPLE_RATE allocations of at most a page is placed
+// at the end of its own page, followed by a PROT_NONE guard page, and the page is protected
+// when the allocation is freed. Overflows and uses after free of these allocations then crash
+// right away, with a report of where the memory was allocated and freed.
+// At most FT_MALLOC_GUARDED_SLOTS guarded allocations exist at a time, and freed
+// slots are only reused after all the other ones. 0 disables sampling.
+// A sample costs about 12 us, so a rate of 100000 keeps the CPU overhead around 0.5%
+// for 22 ns alloc/free pairs, as measured by Tests/guarded.
+#define FT_MALLOC_GUARDED_SAMPLE_RATE 0
+#define FT_MALLOC_GUARDED_SLOTS 64
+
+// Define FT_MALLOC_OUT_OF_LINE_METADATA to keep bucket headers in their own pages
+// instead of in front of each block, so bucket pages only contain user data.
+// Frees then look the bucket up in a page map instead of reading a header.
+// #define FT_MALLOC_OUT_OF_LINE_METADATA
+
+// Static tracepoints on the slow paths, see Source/probes.h and the scripts in Tools/.
+// They are on by default on x86-64, define FT_MALLOC_NO_USDT_PROBES to remove them.
+#if defined(__x86_64__) && !defined(FT_MALLOC_NO_USDT_PROBES) && !defined(FT_MALLOC_USDT_PROBES)
+#define FT_MALLOC_USDT_PROBES
+#endif
+
+// Define FT_MALLOC_PER_CPU_ARENAS to make Alloc, Realloc and Free thread safe.
+// Each CPU then gets its own heap, memory overhead scales with the number of CPUs.
+// #define FT_MALLOC_PER_CPU_ARENAS
+#define FT_MALLOC_MAX_ARENAS 64
+
+// Define FT_MALLOC_NUMA_AWARE on top of FT_MALLOC_PER_CPU_ARENAS to bind
+// the memory of each arena to the NUMA node of its CPU
+// #define FT_MALLOC_NUMA_AWARE
+#define FT_MALLOC_MAX_NUMA_NODES 64
+
+#if defined(FT_MALLOC_NUMA_AWARE) && !defined(FT_MALLOC_PER_CPU_ARENAS)
+#error "FT_MALLOC_NUMA_AWARE requires FT_MALLOC_PER_CPU_ARENAS"
+#endif
 
 struct MemoryHeap *CreateHeap();
 void DestroyHeap(struct MemoryHeap *heap);
 
+// Creates a heap that lives entirely in a file mapped with MAP_SHARED, or attaches the
+// heap a previous process left in it. The file is always mapped at the address it was
+// created at, so pointers into the heap stay valid across restarts. size is only used
+// to create the file. Only one process can attach the file at a time, and DestroyHeap
+// detaches it without freeing anything. A heap that was not detached, for example
+// because its process crashed, is refused.
+// Returns NULL and sets errno on failure (EBUSY if the file is attached,
+// EEXIST if its address is taken, EINVAL if it is not a valid heap file).
+struct MemoryHeap *CreateHeapFromFile(const char *path, size_t size);
+
+// Address of the file mapping when it is created, if it is free
+#define FT_MALLOC_HEAP_FILE_BASE 0x600000000000
+
+void SetHeapPoisonMode(struct MemoryHeap *heap, int mode);
+
+// The root is the entry point to the data of a heap file after it is attached again
+void SetHeapRoot(struct MemoryHeap *heap, void *root);
+void *GetHeapRoot(struct MemoryHeap *heap);
+
+// Creates a heap in a memfd that several processes can use at the same time. Children
+// inherit it through fork, other processes attach it with the descriptor stored in fd,
+// for example after receiving it over a unix socket. The heap is mapped at the same
+// address in every process, and it is freed once no process maps it or holds fd.
+// Shared heaps need the shared functions below, and are not supported with
+// FT_MALLOC_OUT_OF_LINE_METADATA (errno is set to ENOTSUP).
+struct MemoryHeap *CreateSharedHeap(size_t size, int *fd);
+struct MemoryHeap *AttachSharedHeap(int fd);
+
+// Thread and process safe versions of HeapAlloc, HeapRealloc and HeapFree. If a process
+// dies while it is inside one of them, the heap may be corrupted, and from then on they
+// fail in every process with errno set to ENOTRECOVERABLE.
+void *SharedHeapAlloc(struct MemoryHeap *heap, size_t size);
+void *SharedHeapRealloc(struct MemoryHeap *heap, void *ptr, size_t new_size);
+void SharedHeapFree(struct MemoryHeap *heap, void *ptr);
+
+// Converts between pointers and offsets from the start of a heap file or shared heap,
+// so allocations can be referred to in messages between processes
+size_t GetHeapOffset(struct MemoryHeap *heap, void *ptr);
+void *GetHeapPointer(struct MemoryHeap *heap, size_t offset);
+
 void *HeapAlloc(struct MemoryHeap *heap, size_t size);
 void *HeapRealloc(struct MemoryHeap *heap, void *ptr, size_t new_size);
 void HeapFree(struct MemoryHeap *heap, void *ptr);
 
+// Makes sure count allocations of size bytes can be made without mapping memory,
+// and keeps that memory mapped when it is freed. Each call replaces the previous
+// reserve of the size class of size, or of all mid or all big sizes.
+// Returns 0 on success, -1 if the memory could not be mapped.
+int HeapReserve(struct MemoryHeap *heap, size_t size, size_t count);
+
+// Lock the memory of the heap in RAM (see mlock)
+#define FT_MALLOC_PREFAULT_LOCK 0x1
+// Also populate (and lock) memory mapped by the heap from now on
+#define FT_MALLOC_PREFAULT_NEW_MEMORY 0x2
+
+// Writes to every page of the heap so later allocations do not page fault.
+// Returns 0 on success, -1 if the memory could not be locked.
+int HeapPrefault(struct MemoryHeap *heap, int flags);
+
+// Called when the memory mapped by heap is about to go over its soft limit,
+// even after trimming. It is called in the middle of an allocation, with the
+// heap locked when it is an arena, so it must not use the heap.
+typedef void (*HeapPressureCallback)(struct MemoryHeap *heap, size_t mapped_bytes, void *data);
+
+// Limits on the bytes a heap maps, 0 means no limit. Going over the soft limit
+// trims the heap and calls the pressure callback. Allocations that would go over
+// the hard limit, even after trimming, return NULL and set errno to ENOMEM.
+void SetHeapLimits(struct MemoryHeap *heap, size_t soft_limit, size_t hard_limit);
+// Shared heaps can go over their limits in any process, which can not call code of
+// another process, so they do not support pressure callbacks (errno is set to ENOTSUP).
+// Returns 0 on success, -1 on error.
+int SetHeapPressureCallback(struct MemoryHeap *heap, HeapPressureCallback callback, void *data);
+
+// Releases the memory the heap keeps around for reuse (empty buckets, span
+// chunks and cached big allocations), except what is reserved with HeapReserve.
+// Returns the number of bytes that were unmapped.
+size_t HeapTrim(struct MemoryHeap *heap);
+
+// Movable allocations are accessed through a handle, and can be moved by HeapCompact
+// while they are not pinned. Pinning returns the current address of the memory,
+// which stays valid until the matching unpin.
+typedef struct MovableAllocation *MovableHandle;
+
+MovableHandle HeapAllocMovable(struct MemoryHeap *heap, size_t size);
+void HeapFreeMovable(struct MemoryHeap *heap, MovableHandle handle);
+void *PinMovable(MovableHandle handle);
+void UnpinMovable(MovableHandle handle);
+
+// Moves unpinned movable allocations out of buckets that are at most half full,
+// into the fullest bucket of their size class, and releases the buckets that end up empty.
+// At most budget bytes are copied. Returns the number of bytes that were unmapped.
+size_t HeapCompact(struct MemoryHeap *heap, size_t budget);
+
 extern struct MemoryHeap *global_heap;
 
 void *Alloc(size_t size);
@@ -54,16 +224,91 @@ void *Realloc(void *ptr, size_t new_size);
 void Free(void *ptr);
 void DestroyGlobalHeap();
 
+#ifdef FT_MALLOC_NUMA_AWARE
+// Returns the NUMA node the page of ptr is on, as reported by the kernel, or -1 on error.
+// With a simulated topology, returns the node of the arena ptr was allocated from instead.
+int GetAllocationNumaNode(void *ptr);
+
+// Pretend the machine has num_cpus CPUs spread across num_nodes nodes.
+// Each thread is assigned the next virtual CPU the first time it allocates.
+// Memory is not actually bound to the simulated nodes.
+void SimulateNumaTopology(int num_cpus, int num_nodes);
+#endif
+
 typedef struct AllocationStats
 {
     size_t num_allocated_bytes;
     size_t num_allocation_buckets;
     size_t num_allocations;
     size_t num_bucket_allocations;
+    size_t num_span_allocations;
     size_t num_big_allocations;
 } AllocationStats;
 
 AllocationStats GetAllocationStats();
 void PrintAllocationState();
 
+typedef struct SizeClassLayout
+{
+    size_t alloc_size;
+    size_t num_buckets;
+    size_t num_empty_buckets;
+    size_t capacity;
+    size_t num_allocations;
+    size_t requested_bytes;
+    // Bytes lost to rounding requested sizes up to alloc_size
+    size_t wasted_bytes;
+    size_t mapped_bytes;
+    size_t empty_bucket_bytes;
+} SizeClassLayout;
+
+// Sizes are in bytes. Building a layout only visits buckets and span chunks,
+// never individual allocations, so it is cheap even on big heaps.
+typedef struct HeapLayout
+{
+    SizeClassLayout size_classes[FT_MALLOC_NUM_SIZE_CLASS];
+
+    size_t num_buckets;
+    size_t num_empty_buckets;
+    size_t num_bucket_allocations;
+    size_t bucket_requested_bytes;
+    size_t bucket_wasted_bytes;
+    // Free blocks in buckets that are not empty
+    size_t bucket_free_bytes;
+    size_t bucket_empty_bytes;
+    size_t bucket_mapped_bytes;
+
+    size_t num_span_chunks;
+    size_t num_span_allocations;
+    size_t span_requested_bytes;
+    // Bytes lost to rounding requested sizes up to whole span pages
+    size_t span_wasted_bytes;
+    size_t span_free_bytes;
+    size_t span_largest_free_bytes;
+    size_t span_mapped_bytes;
+
+    size_t num_big_allocations;
+    size_t big_requested_bytes;
+    size_t big_wasted_bytes;
+    size_t big_mapped_bytes;
+    // Freed big allocations kept mapped for HeapReserve
+    size_t num_big_cached;
+    size_t big_cached_bytes;
+
+    // Handles of movable allocations, allocated from page sized blocks
+    size_t num_movable_handles;
+    size_t num_movable_handle_blocks;
+    size_t movable_handle_mapped_bytes;
+
+    size_t num_heaps;
+    size_t num_mappings;
+    size_t num_allocations;
+    size_t requested_bytes;
+    size_t mapped_bytes;
+} HeapLayout;
+
+void GetHeapLayout(struct MemoryHeap *heap, HeapLayout *layout);
+void GetGlobalHeapLayout(HeapLayout *layout);
+void PrintHeapLayout(const HeapLayout *layout);
+
 #endif